@@ -6,70 +6,377 @@
 #pragma comment(lib, "ws2_32.lib")
 
 void ChatWindow::recive_message() {
-    while (running && client_socket != INVALID_SOCKET) {
-        MessageHeader header;
+    // what recv hands over; every whole frame in it is read, a partial one
+    // moves to the front and waits for the rest
+    std::vector<char> buffer(RECEIVE_BUFFER);
+    size_t begin = 0;
+    size_t end = 0;
+    std::vector<char> raw;
 
-        int received = recv(client_socket, (char*)&header, sizeof(header), 0);
-        if (received <= 0) {
-            NetworkEvent event(NetworkEventType::DISCONNECTED);
+    while (running && client_socket != INVALID_SOCKET) {
+        if (begin > 0) {
+            memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
 
-            event_queue.push(event);
-            break;
+        // as much as has arrived, one call for any number of frames
+        int received = recv(client_socket, buffer.data() + end, (int)(buffer.size() - end), 0);
+        bool intact = received > 0;
+        if (intact)
+            end += received;
+
+        // if not my message,paly sound, once per read
+        bool play_public = false;
+        bool play_private = false;
+        // each frame's event is filled in its ring slot and handed over
+        // right away
+        auto read_event = [&](MessageType type, const char* data, size_t size) {
+            NetworkEvent* event = event_slot();
+            if (event == nullptr || !read_frame(type, data, size, *event))
+                return;
+            if (event->sender_id != user_id) {
+                play_public |= event->type == NetworkEventType::PUBLIC_MESSAGE;
+                play_private |= event->type == NetworkEventType::PRIVATE_MESSAGE;
+            }
+            event_ring.publish();
+        };
+
+        while (intact) {
+            MessageHeader header;
+            size_t header_size = 0;
+            int state = header.decode(buffer.data() + begin, end - begin, header_size);
+            if (state < 0)
+                intact = false;
+            if (state <= 0 || end - begin - header_size < header.size)
+                break;
+
+            const char* body = buffer.data() + begin + header_size;
+            begin += header_size + header.size;
+
+            // a batch holds many frames, so does a compressed frame; a
+            // compressed frame that doesn't inflate leaves the stream out of
+            // step, the connection is as good as lost
+            auto read_inner = [&](MessageType type, const char* data, size_t size) {
+                if (type != MessageType::BATCH && type != MessageType::COMPRESSED)
+                    read_event(type, data, size);
+            };
+            if (header.type == MessageType::BATCH) {
+                for_each_frame(body, header.size, read_inner);
+            }
+            else if (header.type == MessageType::COMPRESSED) {
+                intact = inflate_frames(inflater, body, header.size, raw);
+                if (intact)
+                    for_each_frame(raw.data(), raw.size(), read_inner);
+            }
+            else {
+                read_event(header.type, body, header.size);
+            }
         }
 
-        NetworkEvent event;
+        if (!intact) {
+            NetworkEvent* event = event_slot();
+            if (event != nullptr) {
+                event->reset(NetworkEventType::DISCONNECTED);
+                event_ring.publish();
+            }
+        }
 
-        switch (header.type) {
-        case MessageType::PUBLIC_MESSAGE: 
-        {
-            PublicMessage message;
-            recv(client_socket, (char*)&message, sizeof(message), 0);
+        if (play_public)
+            ChatWindow::play_music(NetworkEventType::PUBLIC_MESSAGE);
+        if (play_private)
+            ChatWindow::play_music(NetworkEventType::PRIVATE_MESSAGE);
 
-            event.type = NetworkEventType::PUBLIC_MESSAGE;
-            event.sender = message.sender;
-            event.text = message.content;
+        if (!intact)
             break;
-        }
+    }
+}
 
-        case MessageType::PRIVATE_MESSAGE: 
-        {
-            PrivateMessage private_message;
-            recv(client_socket, (char*)&private_message, sizeof(private_message), 0);
+// the ring slot for the next event, waits while the render loop catches up;
+// null once the connection is being closed
+NetworkEvent* ChatWindow::event_slot() {
+    NetworkEvent* slot;
+    while ((slot = event_ring.claim()) == nullptr) {
+        if (!running)
+            return nullptr;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return slot;
+}
 
-            event.type = NetworkEventType::PRIVATE_MESSAGE;
-            event.sender = private_message.sender;
-            event.target = private_message.target;
-            event.text = private_message.content;
-            break;
+// fill event from one frame, false for frames that don't parse or of
+// unknown types, they add nothing
+bool ChatWindow::read_frame(MessageType type, const char* data, size_t size, NetworkEvent& event) {
+    event.reset(NetworkEventType::CONNECTED);
+
+    switch (type) {
+    case MessageType::CLIENT_ACCEPTED:
+    {
+        ClientAcceptedMessage accepted;
+        if (decode_message(data, size, accepted)) {
+            capabilities = accepted.capabilities;
+            user_id = accepted.user_id;
         }
-       
+        return false;
+    }
 
-        case MessageType::USER_LIST_UPDATE: 
-        {
-            UserListMessage userlist;
-            recv(client_socket, (char*)&userlist, sizeof(userlist), 0);
+    case MessageType::PUBLIC_MESSAGE: 
+    {
+        // read in place, the text is copied once, into the event slot
+        PublicMessageView message;
+        if (!decode_message(data, size, message))
+            return false;
+
+        event.type = NetworkEventType::PUBLIC_MESSAGE;
+        event.sender_id = message.sender;
+        event.text.assign(message.content.data, message.content.size);
+        break;
+    }
+
+    case MessageType::PRIVATE_MESSAGE: 
+    {
+        PrivateMessageView private_message;
+        if (!decode_message(data, size, private_message))
+            return false;
+
+        event.type = NetworkEventType::PRIVATE_MESSAGE;
+        event.sender_id = private_message.sender;
+        event.target_id = private_message.target;
+        event.text.assign(private_message.content.data, private_message.content.size);
+        break;
+    }
+
+    // a long message shows up once its last piece is in
+    case MessageType::PUBLIC_FRAGMENT:
+    {
+        PublicFragmentView fragment;
+        if (!decode_message(data, size, fragment) || !add_fragment(fragment, event.text))
+            return false;
+
+        event.type = NetworkEventType::PUBLIC_MESSAGE;
+        event.sender_id = fragment.sender;
+        break;
+    }
+
+    case MessageType::PRIVATE_FRAGMENT:
+    {
+        PrivateFragmentView fragment;
+        if (!decode_message(data, size, fragment) || !add_fragment(fragment, event.text))
+            return false;
+
+        event.type = NetworkEventType::PRIVATE_MESSAGE;
+        event.sender_id = fragment.sender;
+        event.target_id = fragment.target;
+        break;
+    }
+   
+
+    case MessageType::USER_LIST_UPDATE: 
+    {
+        UserListView userlist;
+        if (!decode_message(data, size, userlist))
+            return false;
+
+        event.type = NetworkEventType::USER_LIST_UPDATE;
+        event.version = userlist.version;
+        event.list_total = userlist.total;
+        event.list_offset = userlist.offset;
+        event.user_ids.reserve(userlist.users.count);
+        event.users.reserve(userlist.users.count);
+        userlist.users.for_each([&](const UserEntryView& user) {
+            event.user_ids.push_back(user.id);
+            event.users.emplace_back(user.name.data, user.name.size);
+        });
+        break;
+    }
+
+    case MessageType::USER_JOINED:
+    case MessageType::USER_LEFT:
+    {
+        PresenceView presence;
+        if (!decode_message(data, size, presence))
+            return false;
+
+        event.type = type == MessageType::USER_JOINED ? NetworkEventType::USER_JOINED : NetworkEventType::USER_LEFT;
+        event.version = presence.version;
+        event.base_version = presence.base_version;
+        event.user_ids.push_back(presence.user_id);
+        event.users.emplace_back(presence.username.data, presence.username.size);
+        break;
+    }
+    
 
-            event.type = NetworkEventType::USER_LIST_UPDATE;
-            for (int i = 0; i < userlist.user_count; i++) {
-                event.users.push_back(userlist.users[i]);
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+// text to target, SYSTEM_USER_ID for everyone; too long for one message it
+// goes in pieces if the server takes them, and text is cut to what was sent
+bool ChatWindow::send_text(uint32_t target, std::string& text) {
+    bool fragments = (capabilities & CAP_FRAGMENTS) != 0;
+    text.resize(utf8_prefix(text.data(), text.size(), fragments ? MAX_FRAGMENTED_TEXT : MAX_TEXT_LENGTH));
+
+    if (text.size() <= MAX_TEXT_LENGTH) {
+        if (target == SYSTEM_USER_ID)
+            return send_message_toserver(PublicMessage(user_id, text));
+        return send_message_toserver(PrivateMessage(user_id, target, text));
+    }
+
+    uint32_t stream = next_stream++;
+    uint32_t total = (uint32_t)text.size();
+    for (size_t offset = 0; offset < text.size();) {
+        size_t end = fragment_end(text, offset);
+        if (end == offset)
+            return false;
+
+        std::string chunk = text.substr(offset, end - offset);
+        bool sent = target == SYSTEM_USER_ID
+            ? send_message_toserver(PublicFragment(user_id, stream, total, (uint32_t)offset, chunk))
+            : send_message_toserver(PrivateFragment(user_id, target, stream, total, (uint32_t)offset, chunk));
+        if (!sent)
+            return false;
+        offset = end;
+    }
+    return true;
+}
+
+// lets an input box grow its string, a paste can be any length
+static int input_resize(ImGuiInputTextCallbackData* data)
+{
+    if (data->EventFlag == ImGuiInputTextFlags_CallbackResize) {
+        std::string* text = (std::string*)data->UserData;
+        text->resize(data->BufTextLen);
+        data->Buf = &(*text)[0];
+    }
+    return 0;
+}
+
+// one line high and multi line, so pasted logs and code keep their lines;
+// enter sends, ctrl+enter starts a new line
+static bool text_input(const char* label, std::string& text)
+{
+    ImGuiInputTextFlags flags = ImGuiInputTextFlags_EnterReturnsTrue | ImGuiInputTextFlags_CtrlEnterForNewLine | ImGuiInputTextFlags_CallbackResize;
+    return ImGui::InputTextMultiline(label, &text[0], text.capacity() + 1, ImVec2(0, ImGui::GetFrameHeight()), flags, input_resize, &text);
+}
+
+// height of a message drawn as "sender:" with its text wrapped beside it,
+// in a log width wide
+static float message_height(const MessageView& message, float width)
+{
+    const ImGuiStyle& style = ImGui::GetStyle();
+    float sender = ImGui::CalcTextSize((message.sender + ":").c_str()).x + style.ItemSpacing.x;
+    float wrap = width - sender > 1.0f ? width - sender : 1.0f;
+    float text = ImGui::CalcTextSize(message.text, message.text + message.size, false, wrap).y;
+    float line = ImGui::GetTextLineHeight();
+    // the line, then the item spacing after it and after Spacing()
+    return (text > line ? text : line) + 2 * style.ItemSpacing.y;
+}
+
+// measures what came into the store past the end of the layout
+static void extend_layout(const MessageStore& messages, LogLayout& layout)
+{
+    while (layout.first + layout.bottoms.size() < messages.end()) {
+        float top = layout.bottoms.empty() ? 0.0f : layout.bottoms.back();
+        layout.bottoms.push_back(top + message_height(messages.at(layout.first + layout.bottoms.size()), layout.width));
+    }
+}
+
+template <typename Color>
+void ChatWindow::draw_log(const char* id, const ImVec2& size, MessageStore& messages, LogLayout& layout, Color color)
+{
+    // line the layout up with what the store holds now; messages that went
+    // from above the view, or were read back in above it, move the scroll
+    // by their height so the view stays on the same messages
+    size_t first = messages.first();
+    size_t end = messages.end();
+    float shift = 0.0f;
+    if (layout.width > 0.0f && first < layout.first + layout.bottoms.size() && end > layout.first) {
+        if (first > layout.first) {
+            size_t gone = first - layout.first;
+            float removed = layout.bottoms[gone - 1];
+            layout.bottoms.erase(layout.bottoms.begin(), layout.bottoms.begin() + gone);
+            for (float& bottom : layout.bottoms)
+                bottom -= removed;
+            shift -= removed;
+        }
+        if (first < layout.first) {
+            std::vector<float> above;
+            float added = 0.0f;
+            for (size_t i = first; i < layout.first; i++) {
+                added += message_height(messages.at(i), layout.width);
+                above.push_back(added);
             }
-            break;
+            for (float& bottom : layout.bottoms)
+                bottom += added;
+            layout.bottoms.insert(layout.bottoms.begin(), above.begin(), above.end());
+            shift += added;
         }
-        
+        layout.first = first;
+        if (layout.bottoms.size() > end - first)
+            layout.bottoms.resize(end - first);
+        extend_layout(messages, layout);
+    }
+    else {
+        layout.first = first;
+        layout.bottoms.clear();
+    }
 
-        default:
-            continue;
-        }
+    float spacing = ImGui::GetStyle().ItemSpacing.y;
+    if (shift != 0.0f && !layout.bottoms.empty()) {
+        // the new height has to be known for the scroll not to be clamped
+        ImGui::SetNextWindowContentSize(ImVec2(0.0f, layout.bottoms.back() - spacing));
+        ImGui::SetNextWindowScroll(ImVec2(-1.0f, layout.scroll + shift));
+    }
+    ImGui::BeginChild(id, size, true);
 
+    float width = ImGui::GetContentRegionAvail().x;
+    if (width != layout.width) {
+        layout.width = width;
+        layout.bottoms.clear();
+    }
+    extend_layout(messages, layout);
+
+    if (!layout.bottoms.empty()) {
+        // the messages the view overlaps, the rest is empty space of the
+        // same height so the scrollbar stays right
+        const std::vector<float>& bottoms = layout.bottoms;
+        float top = ImGui::GetScrollY() - ImGui::GetCursorPosY();
+        float bottom = top + ImGui::GetWindowHeight();
+        size_t from = std::upper_bound(bottoms.begin(), bottoms.end(), top) - bottoms.begin();
+        size_t to = std::lower_bound(bottoms.begin(), bottoms.end(), bottom) - bottoms.begin() + 1;
+        if (to > bottoms.size())
+            to = bottoms.size();
+
+        if (from > 0)
+            ImGui::Dummy(ImVec2(0.0f, bottoms[from - 1] - spacing));
+        for (size_t i = from; i < to; i++) {
+            MessageView message = messages.at(layout.first + i);
+            ImGui::PushStyleColor(ImGuiCol_Text, color(message));
+            ImGui::Text("%s:", message.sender.c_str());
+            ImGui::PopStyleColor();
 
-        {
-            std::lock_guard<std::mutex> lock(event_mutex);
-            event_queue.push(event);
+            ImGui::SameLine();
+            ImGui::TextWrapped("%s", message.text);
+
+            ImGui::Spacing();
         }
-        // if not my message,paly sound
-        if (event.sender != username)
-            ChatWindow::play_music(event.type);
+        if (to < bottoms.size())
+            ImGui::Dummy(ImVec2(0.0f, bottoms.back() - bottoms[to - 1] - spacing));
+
+        // close to either end of what is in memory the next page comes
+        // off disk, it shows from the next frame
+        float view = ImGui::GetWindowHeight();
+        if (top < view)
+            messages.page_back();
+        else if (bottom > bottoms.back() - view)
+            messages.page_forward();
     }
+
+    layout.scroll = ImGui::GetScrollY();
+    ImGui::EndChild();
 }
 
 // paly message music
@@ -144,9 +451,15 @@ bool ChatWindow::connect_server(const std::string& ip, int port, const std::stri
         return false;
     }
 
-    ClientConnectMessage connect_message(user_name);
+    // nothing is compressed until the server takes this connection in
+    capabilities = 0;
+    deflater = LzEncoder();
+    inflater = LzDecoder();
+    pending_texts.clear();
+
+    ClientConnectMessage connect_message(user_name, CLIENT_CAPABILITIES);
 
-    if (!send_message_toserver(MessageType::CLIENT_CONNECT, &connect_message, sizeof(connect_message))) {
+    if (!send_message_toserver(connect_message)) {
         std::cerr << "Failed to send connect message" << std::endl;
         if (client_socket != INVALID_SOCKET) {
             closesocket(client_socket);
@@ -159,6 +472,13 @@ bool ChatWindow::connect_server(const std::string& ip, int port, const std::stri
     username = user_name;
     connected = true;
     running = true;
+    user_id = 0;
+    user_names.clear();
+    user_ids.clear();
+    presence_version = 0;
+    userlist_requested = false;
+    listing_version = 0;
+    listing_departed.clear();
 
     // receive thread
     recieve_thread = std::thread(&ChatWindow::recive_message, this);
@@ -174,8 +494,7 @@ void ChatWindow::close_connect() {
 
     // send disconnect message
     if (client_socket != INVALID_SOCKET) {
-        MessageHeader header(MessageType::CLIENT_DISCONNECT, 0);
-        send(client_socket, (char*)&header, sizeof(header), 0);
+        send_message_toserver(MessageType::CLIENT_DISCONNECT, nullptr, 0);
     }
 
     // wait thread
@@ -195,43 +514,164 @@ void ChatWindow::close_connect() {
     public_message.push_back(ChatMessage("System", "Disconnected from server"));
 }
 
-void ChatWindow::update_userlist(const std::vector<std::string>& users) {
+void ChatWindow::update_userlist(const NetworkEvent& event) {
+    if (event.type == NetworkEventType::USER_LIST_UPDATE) {
+        add_userlist_page(event);
+        return;
+    }
+
+    // a change the list already includes
+    if (event.version <= presence_version)
+        return;
+
+    // the first page is still on its way
+    if (presence_version == 0)
+        return;
+
+    // missed a change, a new list replaces everything we have
+    if (event.base_version != presence_version) {
+        if (!userlist_requested)
+            userlist_requested = send_message_toserver(UserListRequest());
+        return;
+    }
+    presence_version = event.version;
+
+    uint32_t id = event.user_ids[0];
+    if (event.type == NetworkEventType::USER_JOINED)
+        user_names[id] = event.users[0];
+    const std::string user = name_of(id);
+
+    if (event.type == NetworkEventType::USER_JOINED) {
+        set_online(user, true);
+        user_ids[user] = id;
+        listing_departed.erase(id);
+        public_message.push_back(ChatMessage("System", user + " joined the chat"));
+    }
+    else {
+        if (user != username)
+            set_online(user, false);
+        auto known = user_ids.find(user);
+        if (known != user_ids.end() && known->second == id)
+            user_ids.erase(known);
+        if (listing_version != 0)
+            listing_departed.insert(id);
+        public_message.push_back(ChatMessage("System", user + " left the chat"));
+    }
+}
+
+std::string ChatWindow::name_of(uint32_t id) const {
+    if (id == SYSTEM_USER_ID)
+        return "System";
+    auto it = user_names.find(id);
+    // a message that beat its sender's join
+    if (it == user_names.end())
+        return "user #" + std::to_string(id);
+    return it->second;
+}
+
+void ChatWindow::set_online(const std::string& user, bool online) {
+    auto it = online_at.find(user);
+    if (online && it == online_at.end()) {
+        online_at.emplace(user, users_online.insert(users_online.end(), user));
+    }
+    else if (!online && it != online_at.end()) {
+        users_online.erase(it->second);
+        online_at.erase(it);
+    }
+}
+
+void ChatWindow::clear_online() {
     users_online.clear();
+    online_at.clear();
+}
 
-    // add all users
-    for (const auto& user : users) {
-        if (!user.empty()) {
-            users_online.push_back(user);
-        }
+void ChatWindow::add_userlist_page(const NetworkEvent& event) {
+    if (event.list_offset == 0) {
+        // older than the changes we already applied
+        if (event.version < presence_version)
+            return;
+
+        // a new list, the joins and leaves after it build on its version
+        presence_version = event.version;
+        userlist_requested = false;
+        clear_online();
+        user_ids.clear();
+        listing_version = event.version;
+        listing_total = event.list_total;
+        listing_received = 0;
+        listing_departed.clear();
+    }
+    else if (listing_version == 0 || event.version != listing_version || event.list_offset != listing_received) {
+        // a page of a list we already replaced
+        return;
     }
 
-    // add my username
-    bool found = false;
-    for (const auto& user : users_online) {
-        if (user == username) {
-            found = true;
-            break;
-        }
+    // changes applied while the list streamed are newer than the page
+    for (size_t i = 0; i < event.users.size(); i++) {
+        const std::string& user = event.users[i];
+        uint32_t id = event.user_ids[i];
+        user_names[id] = user;
+        if (user.empty() || listing_departed.count(id))
+            continue;
+        user_ids[user] = id;
+        set_online(user, true);
+    }
+    listing_received += (uint32_t)event.users.size();
+
+    // pull the next page only once this one is in
+    if (listing_received < listing_total && !event.users.empty()) {
+        send_message_toserver(UserListRequest(listing_version, listing_received));
     }
-    if (!found) {
-        users_online.push_back(username);
+    else {
+        listing_version = 0;
+        listing_departed.clear();
+        std::cout << "update userlist" << std::endl;
     }
-    
 
-    std::cout << "update userlist" << std::endl;
+    // add my username
+    set_online(username, true);
 }
 
 
-// process different type events
+// the public messages at the front of the ring, appended in one go;
+// returns how many slots they took
+size_t ChatWindow::append_public() {
+    size_t count = 0;
+    // a flood is mostly a few senders, the name is looked up once per run
+    // of the same one
+    uint32_t last_id = SYSTEM_USER_ID;
+    std::string last_name;
+
+    while (count < PUBLIC_BATCH) {
+        NetworkEvent* event = event_ring.peek(count);
+        if (event == nullptr || event->type != NetworkEventType::PUBLIC_MESSAGE)
+            break;
+        count++;
+        if (event->sender_id != user_id) {
+            if (event->sender_id != last_id) {
+                last_id = event->sender_id;
+                last_name = name_of(last_id);
+            }
+            public_message.add(last_name, event->text.data(), event->text.size());
+        }
+        event->release();
+    }
+    return count;
+}
+
+// process different type events, as many as fit in the frame budget
 void ChatWindow::process_event() {
+    auto deadline = std::chrono::steady_clock::now() + EVENT_FRAME_BUDGET;
 
-    while (!event_queue.empty()) {
-        // get event
-        NetworkEvent event;
-        {
-            std::lock_guard<std::mutex> lock(event_mutex);
-            event = event_queue.front();
-            event_queue.pop();
+    // read in place, the slot goes back to the receive thread after
+    while (NetworkEvent* slot = event_ring.front()) {
+        NetworkEvent& event = *slot;
+
+        if (batch_public && event.type == NetworkEventType::PUBLIC_MESSAGE) {
+            event_ring.pop(append_public());
+            if (std::chrono::steady_clock::now() >= deadline)
+                break;
+            continue;
         }
 
         switch (event.type) {
@@ -240,46 +680,51 @@ void ChatWindow::process_event() {
             close_connect();
             public_message.push_back(ChatMessage("System", "Connect lost"));
             // clear all users
-            users_online.clear();
+            clear_online();
             if (!username.empty()) {
-                users_online.push_back(username);
+                set_online(username, true);
             }
             break;
 
         case NetworkEventType::PUBLIC_MESSAGE:
-            if (event.sender != username) 
-            public_message.push_back(ChatMessage(event.sender, event.text));
+            if (event.sender_id != user_id) 
+            public_message.add(name_of(event.sender_id), event.text.data(), event.text.size());
             break;
 
         case NetworkEventType::PRIVATE_MESSAGE:
         {
+            event.sender = name_of(event.sender_id);
+            event.target = name_of(event.target_id);
             std::string name = (event.sender == username) ? event.target : event.sender;
 
             // check private chat map
-            if (private_chat.find(name) == private_chat.end())
-            {
-                private_chat[name] = std::vector<ChatMessage>();
-            }
+            MessageStore& chat = private_chat.try_emplace(name, PRIVATE_LOG_BUDGET).first->second;
 
             // add chat message
-            ChatMessage mess(event.sender, event.text, true, event.target);
-            private_chat[name].push_back(mess);
+            chat.add(event.sender, event.text.data(), event.text.size(), true, event.target);
 
             if (private_input.find(name) == private_input.end())
             {
-                private_input[name].fill('\0');
+                private_input[name].clear();
             }
         }
             break;
 
         case NetworkEventType::USER_LIST_UPDATE:
+        case NetworkEventType::USER_JOINED:
+        case NetworkEventType::USER_LEFT:
             // when someone link the server
-            update_userlist(event.users);
+            update_userlist(event);
             break;
 
         default:
             break;
         }
+        event.release();
+        event_ring.pop();
+
+        if (std::chrono::steady_clock::now() >= deadline)
+            break;
     }
 }
 
@@ -299,8 +744,8 @@ void ChatWindow::user_win() {
             if (ImGui::Selectable(user.c_str())) {
                 // open chat
                 if (private_chat.find(user) == private_chat.end()) {
-                    private_chat[user] = std::vector<ChatMessage>();
-                    private_input[user].fill('\0');
+                    private_chat.try_emplace(user, PRIVATE_LOG_BUDGET);
+                    private_input[user].clear();
                 }
             }
 
@@ -316,30 +761,14 @@ void ChatWindow::user_win() {
 
 void ChatWindow::chat_win() {
 
-    ImGui::BeginChild("Chat messages", ImVec2(0, -ImGui::GetFrameHeightWithSpacing() * 1.5f), true);
-
-    for (const auto& p_message : public_message) {
+    draw_log("Chat messages", ImVec2(0, -ImGui::GetFrameHeightWithSpacing() * 1.5f), public_message, public_layout, [this](const MessageView& p_message) {
         // set user color
-        if (p_message.sender == username) {
-            ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.2f, 0.8f, 0.2f, 1.0f));
-        }
-        else if (p_message.sender == "System") {
-            ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 0.5f, 0.0f, 1.0f));
-        }
-        else {
-            ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.8f, 0.8f, 0.2f, 1.0f));
-        }
-
-        ImGui::Text("%s:", p_message.sender.c_str());
-        ImGui::PopStyleColor();
-
-        ImGui::SameLine();
-        ImGui::TextWrapped("%s", p_message.text.c_str());
-
-        ImGui::Spacing();
-    }
-
-    ImGui::EndChild();
+        if (p_message.sender == username)
+            return ImVec4(0.2f, 0.8f, 0.2f, 1.0f);
+        if (p_message.sender == "System")
+            return ImVec4(1.0f, 0.5f, 0.0f, 1.0f);
+        return ImVec4(0.8f, 0.8f, 0.2f, 1.0f);
+    });
 
     // input
     ImGui::Separator();
@@ -350,7 +779,7 @@ void ChatWindow::chat_win() {
     ImGui::PushItemWidth(-60);
     bool sendPublic = false;
     // press endter
-    if (ImGui::InputText("##PublicInput", public_input, sizeof(public_input), ImGuiInputTextFlags_EnterReturnsTrue)) 
+    if (text_input("##PublicInput", public_input)) 
     {
         sendPublic = true;
     }
@@ -358,17 +787,15 @@ void ChatWindow::chat_win() {
 
     ImGui::SameLine();
     if (ImGui::Button("Send", ImVec2(50, 0)) || sendPublic) {
-        if (strlen(public_input) > 0) {
+        if (!public_input.empty()) {
             // send
-            PublicMessage message(username, public_input);
-
-            if (send_message_toserver(MessageType::PUBLIC_MESSAGE, &message, sizeof(message))) {
+            if (send_text(SYSTEM_USER_ID, public_input)) {
                 // show at local
                 ChatMessage mess(username, public_input);
                 public_message.push_back(mess);
             }
             // clear input
-            public_input[0] = '\0';
+            public_input.clear();
         }
     }
 }
@@ -376,7 +803,7 @@ void ChatWindow::chat_win() {
 void ChatWindow::private_win() {
     for (auto it = private_chat.begin(); it != private_chat.end();) {
         const std::string targetUser = it->first;
-        std::vector<ChatMessage>& messages = it->second;
+        MessageStore& messages = it->second;
 
         std::string title = "Private: " + targetUser;
         bool isopen = true;
@@ -385,27 +812,12 @@ void ChatWindow::private_win() {
         // imgui can renmber last window's detail by title
         if (ImGui::Begin(title.c_str(), &isopen)) {
 
-            ImGui::BeginChild("PrivateMessages", ImVec2(0, -ImGui::GetFrameHeightWithSpacing() * 1.5f), true);
-
-            for (const auto& mes : messages) {
+            draw_log("PrivateMessages", ImVec2(0, -ImGui::GetFrameHeightWithSpacing() * 1.5f), messages, private_layout[targetUser], [this](const MessageView& mes) {
                 // color
-                if (mes.sender == username) {
-                    ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.5f, 0.1f, 0.5f, 1.0f));
-                }
-                else {
-                    ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.1f, 0.5f, 0.1f, 1.0f));
-                }
-
-                ImGui::Text("%s:", mes.sender.c_str());
-                ImGui::PopStyleColor();
-
-                ImGui::SameLine();
-                ImGui::TextWrapped("%s", mes.text.c_str());
-
-                ImGui::Spacing();
-            }
-
-            ImGui::EndChild();
+                if (mes.sender == username)
+                    return ImVec4(0.5f, 0.1f, 0.5f, 1.0f);
+                return ImVec4(0.1f, 0.5f, 0.1f, 1.0f);
+            });
 
             // input
             ImGui::Separator();
@@ -417,7 +829,7 @@ void ChatWindow::private_win() {
             ImGui::PushItemWidth(-60);
             bool send = false;
             // press endter
-            if (ImGui::InputText("##PrivateInput", input_buff.data(), input_buff.size(),ImGuiInputTextFlags_EnterReturnsTrue)) 
+            if (text_input("##PrivateInput", input_buff)) 
             {
                 send = true;
             }
@@ -425,28 +837,25 @@ void ChatWindow::private_win() {
 
             ImGui::SameLine();
             if (ImGui::Button("Send", ImVec2(50, 0)) || send) {
-                if (strlen(input_buff.data()) > 0) {
-                    PrivateMessage message(username, targetUser, input_buff.data());
-
-                    if (send_message_toserver(MessageType::PRIVATE_MESSAGE, &message, sizeof(message))) {
+                // someone who left can't get it
+                auto target = user_ids.find(targetUser);
+                if (!input_buff.empty() && target != user_ids.end()) {
+                    if (send_text(target->second, input_buff)) {
                         std::string name = (username == username) ? targetUser : username;
 
                         // check private chat map
-                        if (private_chat.find(name) == private_chat.end())
-                        {
-                            private_chat[name] = std::vector<ChatMessage>();
-                        }
+                        MessageStore& chat = private_chat.try_emplace(name, PRIVATE_LOG_BUDGET).first->second;
 
                         // add chat message
-                        ChatMessage mess(username, input_buff.data(), true, targetUser);
-                        private_chat[name].push_back(mess);
+                        ChatMessage mess(username, input_buff, true, targetUser);
+                        chat.push_back(mess);
 
                         if (private_input.find(name) == private_input.end())
                         {
-                            private_input[name].fill('\0');
+                            private_input[name].clear();
                         }
                     }
-                    input_buff.fill('\0');
+                    input_buff.clear();
                 }
             }
         }
@@ -457,6 +866,7 @@ void ChatWindow::private_win() {
         if (!isopen) {
             it = private_chat.erase(it);
             private_input.erase(targetUser);
+            private_layout.erase(targetUser);
         }
         else {
             ++it;
@@ -532,17 +942,23 @@ void ChatWindow::render_all() {
 
             ImGui::BeginChild("Messages", ImVec2(0, 0), true);
 
-            for (const auto& message : public_message) {
-                if (message.sender == "System") {
-                    ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 0.5f, 0.0f, 1.0f));
-                }
-                else 
-                {
-                    ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.5f, 0.5f, 0.5f, 1.0f));
-                }
+            // a line each, only the lines in view are drawn
+            ImGuiListClipper clipper;
+            clipper.Begin((int)(public_message.end() - public_message.first()));
+            while (clipper.Step()) {
+                for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
+                    MessageView message = public_message.at(public_message.first() + i);
+                    if (message.sender == "System") {
+                        ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 0.5f, 0.0f, 1.0f));
+                    }
+                    else 
+                    {
+                        ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.5f, 0.5f, 0.5f, 1.0f));
+                    }
 
-                ImGui::Text("%s: %s", message.sender.c_str(), message.text.c_str());
-                ImGui::PopStyleColor();
+                    ImGui::Text("%s: %s", message.sender.c_str(), message.text);
+                    ImGui::PopStyleColor();
+                }
             }
 
             ImGui::EndChild();
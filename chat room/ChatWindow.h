@@ -6,13 +6,17 @@
 #include <ws2tcpip.h>
 #include <string>
 #include <vector>
+#include <list>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include "imgui.h"
 #include <thread>
 #include <atomic>
-#include <mutex>
-#include <queue>
 #include "net_protocol.h"
+#include "lz_codec.h"
+#include "spsc_ring.h"
+#include "message_store.h"
 #include <fmod.hpp>
 #include <fmod_errors.h>
 #include <cmath>
@@ -23,15 +27,45 @@
 #include <array>
 #pragma comment(lib, "fmod_vc.lib")
 
-struct ChatMessage {
-    std::string sender;
-    std::string target;
+// features this client understands, the server says which it uses
+const uint32_t CLIENT_CAPABILITIES = CAP_BATCH | CAP_PRESENCE_DELTA | CAP_COMPRESSION | CAP_FRAGMENTS;
+// receive buffer, holds the biggest frame with room to spare
+const size_t RECEIVE_BUFFER = 2 * MAX_FRAME_BODY;
+// events the receive thread can be ahead of the render loop, past that it
+// stops reading until the render loop catches up
+const size_t EVENT_RING_SIZE = 4096;
+// time the render loop gives incoming events each frame, what is left
+// waits for the next frame so a flood can't stall one
+const std::chrono::microseconds EVENT_FRAME_BUDGET(4000);
+// most public messages appended as one run
+const size_t PUBLIC_BATCH = 256;
+
+// memory a log keeps its newest messages in, the older ones are read back
+// from disk when scrolled to
+const size_t PUBLIC_LOG_BUDGET = 8 * 1024 * 1024;
+const size_t PRIVATE_LOG_BUDGET = 1024 * 1024;
+
+// where the messages a log holds in memory sit once wrapped, kept between
+// frames and worked out again only when the log is drawn at another width
+struct LogLayout {
+    float width;
+    // the message bottoms[0] belongs to
+    size_t first;
+    // bottom edge of every message laid out so far, from the top of the log
+    std::vector<float> bottoms;
+    // where the view was scrolled to last frame
+    float scroll;
+
+    LogLayout() : width(0), first(0), scroll(0) {}
+};
+
+// a long message while its pieces arrive
+struct PendingText {
+    uint32_t stream;
+    uint32_t total;
     std::string text;
-    bool isPrivate;
 
-    ChatMessage(const std::string& s = "", const std::string& t = "", bool priv = false, const std::string& tar = "")
-        : sender(s), text(t), isPrivate(priv), target(tar) {
-    }
+    PendingText() : stream(0), total(0) {}
 };
 
 enum class NetworkEventType {
@@ -39,7 +73,9 @@ enum class NetworkEventType {
     DISCONNECTED,
     PUBLIC_MESSAGE,
     PRIVATE_MESSAGE,
-    USER_LIST_UPDATE
+    USER_LIST_UPDATE,
+    USER_JOINED,
+    USER_LEFT
 };
 
 struct NetworkEvent {
@@ -47,22 +83,90 @@ struct NetworkEvent {
     std::string sender;
     std::string text;
     std::string target;
+    // chat frames carry ids, the names are looked up when the event is
+    // processed
+    uint32_t sender_id;
+    uint32_t target_id;
     std::vector<std::string> users;
+    std::vector<uint32_t> user_ids;
+    // presence version of a user list or join/leave, and the version
+    // a join/leave applies on top of
+    uint32_t version;
+    uint32_t base_version;
+    // where a user list page sits in the whole list
+    uint32_t list_total;
+    uint32_t list_offset;
+
+    NetworkEvent() : type(NetworkEventType::CONNECTED), sender_id(0), target_id(0), version(0), base_version(0), list_total(0), list_offset(0) {}
+    NetworkEvent(NetworkEventType t) : type(t), sender_id(0), target_id(0), version(0), base_version(0), list_total(0), list_offset(0) {}
+
+    // start over as a new event, the strings and lists keep their capacity
+    void reset(NetworkEventType t) {
+        type = t;
+        sender.clear();
+        text.clear();
+        target.clear();
+        sender_id = 0;
+        target_id = 0;
+        users.clear();
+        user_ids.clear();
+        version = 0;
+        base_version = 0;
+        list_total = 0;
+        list_offset = 0;
+    }
 
-    NetworkEvent() : type(NetworkEventType::CONNECTED) {}
-    NetworkEvent(NetworkEventType t) : type(t) {}
+    // once handled: a text rebuilt from pieces can be up to
+    // MAX_FRAGMENTED_TEXT, the slot doesn't keep a buffer that size
+    void release() {
+        if (text.capacity() > MAX_TEXT_LENGTH)
+            std::string().swap(text);
+    }
 };
 
 class ChatWindow {
 public:
     std::string username;
-    std::vector<std::string> users_online;
-    std::vector<ChatMessage> public_message;
-    std::map<std::string, std::vector<ChatMessage>> private_chat;
+    // my id, the server sends it when it takes me in, with the
+    // capabilities the connection uses
+    std::atomic<uint32_t> user_id;
+    std::atomic<uint32_t> capabilities;
+    // in the order they came online, and where each name is in it, a join
+    // or leave doesn't search the list
+    std::list<std::string> users_online;
+    std::unordered_map<std::string, std::list<std::string>::iterator> online_at;
+    // name of every id seen on this connection, ids aren't reused so old
+    // messages keep their sender after they leave
+    std::unordered_map<uint32_t, std::string> user_names;
+    // ids of the users online, private messages are sent to the id
+    std::map<std::string, uint32_t> user_ids;
+    // presence version users_online is at, 0 before the first full list
+    uint32_t presence_version;
+    // asked the server for a full list after a missed change
+    bool userlist_requested;
+    // the list arrives a page at a time, version 0 when none is streaming
+    uint32_t listing_version;
+    uint32_t listing_total;
+    uint32_t listing_received;
+    // users who left while the list streamed, a later page from the
+    // older snapshot must not bring them back
+    std::set<uint32_t> listing_departed;
+    MessageStore public_message;
+    // public messages back to back in the ring are appended as one run,
+    // off every one is handled as its own event
+    bool batch_public;
+    std::map<std::string, MessageStore> private_chat;
+    LogLayout public_layout;
+    std::map<std::string, LogLayout> private_layout;
 
-    // input buffer
-    char public_input[200];
-    std::map<std::string, std::array<char, 200>> private_input;
+    // input buffer, grows with what is typed or pasted
+    std::string public_input;
+    std::map<std::string, std::string> private_input;
+    // numbers my long messages
+    uint32_t next_stream;
+    // long messages whose pieces are arriving, by sender; only the receive
+    // thread touches it
+    std::unordered_map<uint32_t, PendingText> pending_texts;
 
     bool connected;
 
@@ -70,14 +174,27 @@ public:
     SOCKET client_socket;
     std::thread recieve_thread;
     std::atomic<bool> running;
-    std::queue<NetworkEvent> event_queue;
-    std::mutex event_mutex;
+    // receive thread to render loop, filled and read in place
+    SpscRing<NetworkEvent> event_ring;
+    // compression state of the connection, one per direction: what I send
+    // is compressed on the UI thread, what arrives is inflated on the
+    // receive thread
+    LzEncoder deflater;
+    LzDecoder inflater;
 
     FMOD::System* system;
 
-    ChatWindow() {
+    ChatWindow() : public_message(PUBLIC_LOG_BUDGET), event_ring(EVENT_RING_SIZE) {
         username = "";
-        public_input[0] = '\0';
+        user_id = 0;
+        capabilities = 0;
+        presence_version = 0;
+        userlist_requested = false;
+        listing_version = 0;
+        listing_total = 0;
+        listing_received = 0;
+        next_stream = 0;
+        batch_public = true;
         connected = false;
         client_socket = INVALID_SOCKET;
         running = false;
@@ -93,26 +210,91 @@ public:
 
     bool send_message_toserver(MessageType type, const void* data, int size) {
 
-        MessageHeader header(type, size);
+        // header and body in one buffer, one send per message
+        std::vector<char> frame(MAX_FRAME_HEADER + size);
+        size_t header_size = MessageHeader(type, size).encode(frame.data());
+        if (size > 0)
+            memcpy(frame.data() + header_size, data, size);
+        frame.resize(header_size + size);
 
-        if (send(client_socket, (char*)&header, sizeof(header), 0) == SOCKET_ERROR) {
-            return false;
+        // a frame worth it goes out in a COMPRESSED frame once the server
+        // said it takes them
+        if ((capabilities & CAP_COMPRESSION) != 0 && frame.size() >= LZ_MIN_INPUT && frame.size() <= MAX_BATCH_BODY) {
+            WireWriter out;
+            out.varint(frame.size());
+            deflater.compress(frame.data(), frame.size(), out);
+
+            frame.resize(MAX_FRAME_HEADER + out.bytes.size());
+            header_size = MessageHeader(MessageType::COMPRESSED, (unsigned int)out.bytes.size()).encode(frame.data());
+            memcpy(frame.data() + header_size, out.bytes.data(), out.bytes.size());
+            frame.resize(header_size + out.bytes.size());
         }
 
-        if (send(client_socket, (char*)data, size, 0) == SOCKET_ERROR) {
+        return send_all(frame.data(), (int)frame.size());
+    }
+
+    // any message with a schema, sent as the type its schema names
+    template <typename M>
+    bool send_message_toserver(const M& message) {
+        std::vector<char> body = encode_message(message);
+        return send_message_toserver(message_type(message), body.data(), (int)body.size());
+    }
+
+    bool send_text(uint32_t target, std::string& text);
+
+    // one piece of a long message, true once text holds all of it
+    template <typename F>
+    bool add_fragment(const F& fragment, std::string& text) {
+        PendingText& pending = pending_texts[fragment.sender];
+        if (fragment.offset == 0) {
+            pending.stream = fragment.stream;
+            pending.total = fragment.total;
+            pending.text.clear();
+        }
+        else if (pending.stream != fragment.stream || pending.total != fragment.total || pending.text.size() != fragment.offset) {
+            // a piece went missing, the text is lost
+            pending_texts.erase(fragment.sender);
             return false;
         }
 
+        pending.text.append(fragment.chunk.data, fragment.chunk.size);
+        if (pending.text.size() < pending.total)
+            return false;
+        text = std::move(pending.text);
+        pending_texts.erase(fragment.sender);
+        return true;
+    }
+
+    bool send_all(const char* data, int size) {
+        while (size > 0) {
+            int sent = send(client_socket, data, size, 0);
+            if (sent == SOCKET_ERROR)
+                return false;
+            data += sent;
+            size -= sent;
+        }
         return true;
     }
 
-    void update_userlist(const std::vector<std::string>& users);
+    // one list page or one join/leave
+    void update_userlist(const NetworkEvent& event);
+    void add_userlist_page(const NetworkEvent& event);
+    std::string name_of(uint32_t id) const;
+    void set_online(const std::string& user, bool online);
+    void clear_online();
 
     void recive_message();
+    NetworkEvent* event_slot();
+    bool read_frame(MessageType type, const char* data, size_t size, NetworkEvent& event);
     void process_event();
+    size_t append_public();
 
 
     void render_all();
+    // a log in a child window of its own, only the part in view is drawn;
+    // color picks the sender's color
+    template <typename Color>
+    void draw_log(const char* id, const ImVec2& size, MessageStore& messages, LogLayout& layout, Color color);
     void login_win();
     void chat_win();
     void private_win();
@@ -0,0 +1,158 @@
+﻿#pragma once
+// LZ77 stream compression with a window shared across messages
+//
+// each direction of a connection has an LzEncoder on the sending side and an
+// LzDecoder on the receiving side; both keep the last LZ_WINDOW bytes that
+// went through them, so a match can point back into earlier messages, which
+// is what makes short chat lines compress at all
+//
+// compressed data is a run of sequences
+//   varint literal count | literals | varint match length - LZ_MIN_MATCH + 1 | varint distance
+// a match length of 0 has no distance and ends the data
+#include "net_protocol.h"
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+const size_t LZ_WINDOW = 32 * 1024;
+const size_t LZ_MIN_MATCH = 4;
+const int LZ_HASH_BITS = 12;
+// shorter input isn't worth a COMPRESSED frame, it goes out as it is
+const size_t LZ_MIN_INPUT = 32;
+
+// history both sides keep, trimmed back to LZ_WINDOW once it holds twice that
+class LzHistory {
+public:
+    std::vector<char> bytes;
+
+    void trim() {
+        if (bytes.size() < 2 * LZ_WINDOW)
+            return;
+        bytes.erase(bytes.begin(), bytes.end() - LZ_WINDOW);
+    }
+};
+
+class LzEncoder {
+public:
+    LzEncoder() : base(0), table((size_t)1 << LZ_HASH_BITS, 0) {}
+
+    // append the compressed form of data to out
+    void compress(const char* data, size_t size, WireWriter& out) {
+        std::vector<char>& buf = history.bytes;
+        size_t start = buf.size();
+        buf.insert(buf.end(), data, data + size);
+
+        size_t literal = start;
+        size_t i = start;
+        while (i + LZ_MIN_MATCH <= buf.size()) {
+            uint32_t& slot = table[hash(&buf[i])];
+            // positions are counted over the whole stream, the bytes are
+            // compared anyway so a stale slot only costs a miss
+            uint32_t distance = base + (uint32_t)i - slot;
+            slot = base + (uint32_t)i;
+
+            size_t length = 0;
+            if (distance > 0 && distance <= i && distance <= LZ_WINDOW) {
+                const char* from = &buf[i - distance];
+                while (i + length < buf.size() && from[length] == buf[i + length])
+                    length++;
+            }
+            if (length < LZ_MIN_MATCH) {
+                i++;
+                continue;
+            }
+
+            emit_literals(buf, literal, i, out);
+            out.varint(length - LZ_MIN_MATCH + 1);
+            out.varint(distance);
+
+            // later text repeats what's inside a match too
+            for (size_t next = i + 1; next < i + length && next + LZ_MIN_MATCH <= buf.size(); next++) {
+                table[hash(&buf[next])] = base + (uint32_t)next;
+            }
+            i += length;
+            literal = i;
+        }
+
+        emit_literals(buf, literal, buf.size(), out);
+        out.varint(0);
+
+        size_t before = buf.size();
+        history.trim();
+        base += (uint32_t)(before - buf.size());
+    }
+
+private:
+    LzHistory history;
+    // stream position of history.bytes[0]
+    uint32_t base;
+    // last stream position of every hashed 4 byte sequence
+    std::vector<uint32_t> table;
+
+    static uint32_t hash(const char* p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+    }
+
+    static void emit_literals(const std::vector<char>& buf, size_t from, size_t to, WireWriter& out) {
+        out.varint(to - from);
+        out.bytes.insert(out.bytes.end(), buf.begin() + from, buf.begin() + to);
+    }
+};
+
+class LzDecoder {
+public:
+    // the raw_size bytes data decompresses to, false if it doesn't; after a
+    // failure the stream is out of step and the connection has to go
+    bool decompress(const char* data, size_t size, size_t raw_size, std::vector<char>& out) {
+        std::vector<char>& buf = history.bytes;
+        size_t start = buf.size();
+        WireReader in(data, size);
+
+        while (true) {
+            uint64_t literals = in.varint();
+            if (!in.ok || literals > in.size - in.pos || literals > raw_size - (buf.size() - start))
+                return false;
+            buf.insert(buf.end(), in.data + in.pos, in.data + in.pos + literals);
+            in.pos += (size_t)literals;
+
+            uint64_t length = in.varint();
+            if (!in.ok)
+                return false;
+            if (length == 0)
+                break;
+            length += LZ_MIN_MATCH - 1;
+            uint64_t distance = in.varint();
+            if (!in.ok || distance == 0 || distance > buf.size() || distance > LZ_WINDOW
+                || length > raw_size - (buf.size() - start))
+                return false;
+
+            // byte by byte, a match may overlap what it produces
+            size_t from = buf.size() - (size_t)distance;
+            buf.reserve(buf.size() + (size_t)length);
+            for (size_t n = 0; n < length; n++) {
+                buf.push_back(buf[from + n]);
+            }
+        }
+        if (in.pos != in.size || buf.size() - start != raw_size)
+            return false;
+
+        out.assign(buf.begin() + start, buf.end());
+        history.trim();
+        return true;
+    }
+
+private:
+    LzHistory history;
+};
+
+// the frames a COMPRESSED body holds, back to back in raw
+inline bool inflate_frames(LzDecoder& decoder, const char* body, size_t size, std::vector<char>& raw)
+{
+    WireReader in(body, size);
+    uint64_t raw_size = in.varint();
+    if (!in.ok || raw_size > MAX_BATCH_BODY)
+        return false;
+    return decoder.decompress(body + in.pos, size - in.pos, (size_t)raw_size, raw);
+}
@@ -0,0 +1,335 @@
+﻿#pragma once
+// a chat log in a fixed amount of memory
+//
+// every message is appended to a spill file as it arrives; memory holds a
+// run of consecutive messages, normally the newest, packed into chunks of
+// text with the sender and target names interned. past the budget whole
+// chunks are dropped from the end away from the view, and scrolling near
+// either end of what is held reads the next page back from the file
+//
+// the files are the store's own, they go away with it
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+// text bytes and messages in one chunk of the arena
+const size_t STORE_CHUNK_TEXT = 64 * 1024;
+const size_t STORE_CHUNK_MESSAGES = 1024;
+// most messages read back from the spill file at a time; a page also holds
+// no more than half the budget of text, but always at least one message
+const size_t STORE_PAGE = 256;
+
+struct ChatMessage {
+    std::string sender;
+    std::string target;
+    std::string text;
+    bool isPrivate;
+
+    // taken by value, a text moved in from its event isn't copied again
+    ChatMessage(std::string s = "", std::string t = "", bool priv = false, std::string tar = "")
+        : sender(std::move(s)), target(std::move(tar)), text(std::move(t)), isPrivate(priv) {
+    }
+};
+
+// a message where the store keeps it, good until the store changes
+struct MessageView {
+    const std::string& sender;
+    const std::string& target;
+    // NUL ended
+    const char* text;
+    uint32_t size;
+    bool isPrivate;
+};
+
+class MessageStore {
+public:
+    explicit MessageStore(size_t budget) : budget(budget), count(0), spill_size(0), writing(false) {
+        static unsigned int opened = 0;
+        std::error_code error;
+        std::filesystem::path dir = std::filesystem::temp_directory_path(error);
+        std::string name = "chat_room_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count())
+            + "_" + std::to_string(opened++);
+        data_path = dir / (name + ".log");
+        index_path = dir / (name + ".idx");
+
+        std::ios::openmode mode = std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc;
+        if (!error) {
+            data.open(data_path, mode);
+            index.open(index_path, mode);
+        }
+        // without the files nothing spills, what falls out of memory is gone
+        spilling = data.is_open() && index.is_open();
+    }
+    ~MessageStore() {
+        data.close();
+        index.close();
+        std::error_code error;
+        std::filesystem::remove(data_path, error);
+        std::filesystem::remove(index_path, error);
+    }
+    MessageStore(const MessageStore&) = delete;
+    MessageStore& operator=(const MessageStore&) = delete;
+
+    // every message ever added
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    // the messages held in memory, [first, end)
+    size_t first() const { return chunks.empty() ? count : chunks.front().first; }
+    size_t end() const { return chunks.empty() ? count : chunks.back().first + chunks.back().records.size(); }
+
+    void push_back(const ChatMessage& message) {
+        add(message.sender, message.text.data(), message.text.size(), message.isPrivate, message.target);
+    }
+
+    void add(const std::string& sender, const char* text, size_t size, bool is_private = false, const std::string& target = "") {
+        Record record;
+        record.sender = intern(sender);
+        record.target = intern(target);
+        record.size = (uint32_t)size;
+        record.isPrivate = is_private;
+
+        if (spilling)
+            spill(record, text);
+        // while older messages are in view the new one only goes to disk,
+        // it's read back when the view scrolls down to it
+        bool at_tail = end() == count;
+        if (!at_tail && !spilling) {
+            // the older ones in view can't be read back nor can this one,
+            // the log carries on from here
+            chunks.clear();
+            at_tail = true;
+        }
+        count++;
+        if (!at_tail)
+            return;
+        append(chunks, count - 1, record, text);
+        while (memory() > budget && chunks.size() > 1)
+            drop(true);
+    }
+
+    // i in [first(), end())
+    MessageView at(size_t i) const {
+        // the last chunk starting at or before i
+        auto it = std::upper_bound(chunks.begin(), chunks.end(), i,
+            [](size_t i, const Chunk& chunk) { return i < chunk.first; });
+        const Chunk& chunk = *(it - 1);
+        const Record& record = chunk.records[i - chunk.first];
+        return MessageView{ names[record.sender], names[record.target], chunk.text.data() + record.offset, record.size, record.isPrivate };
+    }
+
+    // reads the page before first() back in, the newest chunks go past
+    // the budget; false when there is nothing to read
+    bool page_back() {
+        size_t to = first();
+        if (!spilling || to == 0)
+            return false;
+        size_t from = to > STORE_PAGE ? to - STORE_PAGE : 0;
+        std::deque<Chunk> page;
+        if (!load(from, to, true, page))
+            return false;
+        size_t kept = page.size();
+        chunks.insert(chunks.begin(), std::make_move_iterator(page.begin()), std::make_move_iterator(page.end()));
+        while (memory() > budget && chunks.size() > kept)
+            drop(false);
+        return true;
+    }
+
+    // reads the page after end() back in, the oldest chunks go past the
+    // budget; false when there is nothing to read
+    bool page_forward() {
+        size_t from = end();
+        if (!spilling || from == count)
+            return false;
+        size_t to = count - from > STORE_PAGE ? from + STORE_PAGE : count;
+        std::deque<Chunk> page;
+        if (!load(from, to, false, page))
+            return false;
+        size_t kept = page.size();
+        chunks.insert(chunks.end(), std::make_move_iterator(page.begin()), std::make_move_iterator(page.end()));
+        while (memory() > budget && chunks.size() > kept)
+            drop(true);
+        return true;
+    }
+
+private:
+    struct Record {
+        uint32_t sender;
+        uint32_t target;
+        // where the text starts in its chunk
+        uint32_t offset;
+        uint32_t size;
+        bool isPrivate;
+    };
+
+    // messages first to first + records.size(), their text back to back
+    struct Chunk {
+        size_t first;
+        std::vector<Record> records;
+        std::vector<char> text;
+
+        size_t bytes() const { return records.capacity() * sizeof(Record) + text.capacity(); }
+    };
+
+    // sender, target, size and private flag ahead of each text in the
+    // spill file
+    static const size_t SPILL_HEADER = 13;
+
+    size_t budget;
+    size_t count;
+    std::deque<Chunk> chunks;
+    // a dropped chunk, the next new one takes its buffers
+    std::vector<Chunk> spare;
+
+    // names by id; a deque so views keep pointing at them
+    std::deque<std::string> names;
+    std::unordered_map<std::string, uint32_t> name_ids;
+
+    std::filesystem::path data_path;
+    std::filesystem::path index_path;
+    // messages back to back, and where each one starts as a u64
+    std::fstream data;
+    std::fstream index;
+    uint64_t spill_size;
+    bool spilling;
+    // the files are being appended to, reading seeks away first
+    bool writing;
+
+    uint32_t intern(const std::string& name) {
+        auto it = name_ids.find(name);
+        if (it != name_ids.end())
+            return it->second;
+        uint32_t id = (uint32_t)names.size();
+        names.push_back(name);
+        name_ids.emplace(name, id);
+        return id;
+    }
+
+    size_t memory() const {
+        size_t total = 0;
+        for (const Chunk& chunk : chunks)
+            total += chunk.bytes();
+        return total;
+    }
+
+    // the chunk message i goes in, a new one once the last is full
+    Chunk& chunk_for(std::deque<Chunk>& list, size_t i, size_t size) {
+        if (list.empty() || list.back().records.size() == STORE_CHUNK_MESSAGES
+            || (!list.back().records.empty() && list.back().text.size() + size + 1 > STORE_CHUNK_TEXT)) {
+            list.push_back(fresh_chunk());
+            list.back().first = i;
+        }
+        return list.back();
+    }
+
+    void append(std::deque<Chunk>& list, size_t i, Record record, const char* text) {
+        Chunk& chunk = chunk_for(list, i, record.size);
+        record.offset = (uint32_t)chunk.text.size();
+        chunk.text.insert(chunk.text.end(), text, text + record.size);
+        chunk.text.push_back('\0');
+        chunk.records.push_back(record);
+    }
+
+    Chunk fresh_chunk() {
+        Chunk chunk;
+        if (!spare.empty()) {
+            chunk = std::move(spare.back());
+            spare.pop_back();
+        }
+        else {
+            chunk.records.reserve(STORE_CHUNK_MESSAGES);
+            chunk.text.reserve(STORE_CHUNK_TEXT);
+        }
+        return chunk;
+    }
+
+    void drop(bool oldest) {
+        Chunk& chunk = oldest ? chunks.front() : chunks.back();
+        // one that grew around a long message isn't kept
+        if (spare.empty() && chunk.text.capacity() == STORE_CHUNK_TEXT) {
+            chunk.records.clear();
+            chunk.text.clear();
+            spare.push_back(std::move(chunk));
+        }
+        if (oldest)
+            chunks.pop_front();
+        else
+            chunks.pop_back();
+    }
+
+    void spill(const Record& record, const char* text) {
+        if (!writing) {
+            data.seekp(0, std::ios::end);
+            index.seekp(0, std::ios::end);
+            writing = true;
+        }
+        char header[SPILL_HEADER];
+        memcpy(header, &record.sender, 4);
+        memcpy(header + 4, &record.target, 4);
+        memcpy(header + 8, &record.size, 4);
+        header[12] = record.isPrivate ? 1 : 0;
+        index.write((const char*)&spill_size, sizeof(spill_size));
+        data.write(header, SPILL_HEADER);
+        data.write(text, record.size);
+        spill_size += SPILL_HEADER + record.size;
+        if (!data || !index)
+            spilling = false;
+    }
+
+    // messages of [from, to) from the spill file, in chunks of their own;
+    // the ones next to what is held come first, the newest of the range
+    // when paging back, and the page stops at half the budget of text
+    bool load(size_t from, size_t to, bool back, std::deque<Chunk>& out) {
+        writing = false;
+        // where each message starts, and where the last one ends
+        size_t n = to - from;
+        std::vector<uint64_t> offsets(n + 1, spill_size);
+        index.seekg((std::streamoff)(from * sizeof(uint64_t)));
+        index.read((char*)offsets.data(), (std::streamsize)((to < count ? n + 1 : n) * sizeof(uint64_t)));
+        if (!index) {
+            index.clear();
+            return false;
+        }
+
+        size_t first = 0;
+        size_t last = n;
+        uint64_t limit = budget / 2;
+        while (back && last - first > 1 && offsets[last] - offsets[first] > limit)
+            first++;
+        while (!back && last - first > 1 && offsets[last] - offsets[first] > limit)
+            last--;
+
+        // one message at a time, its text read straight into its chunk
+        data.seekg((std::streamoff)offsets[first]);
+        for (size_t i = first; i < last && data; i++) {
+            char header[SPILL_HEADER];
+            data.read(header, SPILL_HEADER);
+            Record record;
+            memcpy(&record.sender, header, 4);
+            memcpy(&record.target, header + 4, 4);
+            memcpy(&record.size, header + 8, 4);
+            record.isPrivate = header[12] != 0;
+            if (!data || offsets[i + 1] - offsets[i] != SPILL_HEADER + record.size)
+                break;
+
+            Chunk& chunk = chunk_for(out, from + i, record.size);
+            record.offset = (uint32_t)chunk.text.size();
+            chunk.text.resize(chunk.text.size() + record.size + 1);
+            data.read(chunk.text.data() + record.offset, record.size);
+            chunk.text.back() = '\0';
+            chunk.records.push_back(record);
+        }
+        if (!data || out.empty() || out.back().first + out.back().records.size() != from + last) {
+            data.clear();
+            out.clear();
+            return false;
+        }
+        return true;
+    }
+};
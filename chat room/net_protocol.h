@@ -1,7 +1,59 @@
 ﻿#pragma once
 #include <string>
+#include <vector>
+#include <ostream>
 #include <cstdint>
 #include <cstring>
+#include "text_check.h"
+
+// wire format, version 6
+//
+// frame:   varint body size | u8 type | body
+// varint:  unsigned LEB128, 7 bits per byte, least significant group first
+// string:  varint byte count | UTF-8 bytes, no terminator
+// batch:   a frame whose body is whole frames back to back
+// compressed: a frame whose body is varint raw size | LZ data (lz_codec.h),
+//          the raw bytes are whole frames back to back, MAX_BATCH_BODY at most
+//
+// all integers are varints, so the format is the same on every byte order;
+// a receiver can skip frames of types it doesn't know by their size
+//
+// from version 6 on CLIENT_CONNECT starts with version and capabilities in
+// every version, the server answers with the version and capabilities the
+// connection uses; new features come as capabilities, so a server keeps
+// serving clients older than itself down to MIN_PROTOCOL_VERSION
+const uint8_t PROTOCOL_VERSION = 6;
+const uint8_t MIN_PROTOCOL_VERSION = 6;
+
+// optional features, a connection uses those both sides have
+// frames may come packed in BATCH frames
+const uint32_t CAP_BATCH = 1u << 0;
+// presence changes come as USER_JOINED / USER_LEFT, without it the client
+// gets a new user list after every presence window
+const uint32_t CAP_PRESENCE_DELTA = 1u << 1;
+// frames may come in COMPRESSED frames, both ways
+const uint32_t CAP_COMPRESSION = 1u << 2;
+// text longer than MAX_TEXT_LENGTH may come in PUBLIC_FRAGMENT /
+// PRIVATE_FRAGMENT frames, without it only the first piece arrives, as an
+// ordinary message
+const uint32_t CAP_FRAGMENTS = 1u << 3;
+
+// longest name and text, in bytes
+const size_t MAX_NAME_LENGTH = 31;
+const size_t MAX_TEXT_LENGTH = 4096;
+// longest text sent in fragments, receivers drop longer ones
+const size_t MAX_FRAGMENTED_TEXT = 1024 * 1024;
+// a peer that announces a bigger body is broken
+const size_t MAX_FRAME_BODY = 64 * 1024;
+// 5 varint bytes for the size, 1 for the type
+const size_t MAX_FRAME_HEADER = 6;
+// users are named by the id the server gives them when they connect, the
+// name goes out once with the join; ids are never reused while the server runs
+const uint32_t SYSTEM_USER_ID = 0;
+// a batch stops growing at this many body bytes
+const size_t MAX_BATCH_BODY = 16 * 1024;
+// names per user list page, a full page stays around 4 KB
+const uint32_t USER_LIST_PAGE = 128;
 
 enum class MessageType {
     CLIENT_CONNECT = 1,
@@ -9,79 +61,710 @@ enum class MessageType {
     PUBLIC_MESSAGE = 3,
     PRIVATE_MESSAGE = 4,
     USER_LIST_UPDATE = 5,
+    USER_JOINED = 6,
+    USER_LEFT = 7,
+    USER_LIST_REQUEST = 8,
+    BATCH = 9,
+    CLIENT_ACCEPTED = 10,
+    COMPRESSED = 11,
+    PUBLIC_FRAGMENT = 12,
+    PRIVATE_FRAGMENT = 13,
+};
+
+// how much of text fits in max bytes without cutting a UTF-8 sequence
+inline size_t utf8_prefix(const char* text, size_t size, size_t max)
+{
+    if (size <= max)
+        return size;
+    size_t end = max;
+    while (end > 0 && (text[end] & 0xC0) == 0x80)
+        end--;
+    return end;
+}
+
+// builds a message body
+class WireWriter {
+public:
+    std::vector<char> bytes;
+
+    void u8(uint8_t value) {
+        bytes.push_back((char)value);
+    }
+
+    void varint(uint64_t value) {
+        while (value >= 0x80) {
+            bytes.push_back((char)((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        bytes.push_back((char)value);
+    }
+
+    // longer strings are cut at max bytes, back to where a UTF-8 sequence
+    // starts so the receiver still gets valid text
+    void str(const std::string& value, size_t max) {
+        size_t size = utf8_prefix(value.data(), value.size(), max);
+        varint(size);
+        bytes.insert(bytes.end(), value.data(), value.data() + size);
+    }
 };
 
-// message header, send this before send the message content
+// a string inside a received body, nothing is copied; only valid as long as
+// the body is
+struct WireString {
+    const char* data;
+    size_t size;
+
+    WireString() : data(""), size(0) {}
+    WireString(const char* d, size_t s) : data(d), size(s) {}
+
+    std::string str() const { return std::string(data, size); }
+    bool empty() const { return size == 0; }
+};
+
+inline std::ostream& operator<<(std::ostream& out, const WireString& value)
+{
+    return out.write(value.data, value.size);
+}
+
+// reads a message body, a read past the end or an oversized string clears
+// ok and returns zero/empty instead
+class WireReader {
+public:
+    const char* data;
+    size_t size;
+    size_t pos;
+    bool ok;
+
+    WireReader(const char* d, size_t s) : data(d), size(s), pos(0), ok(true) {}
+
+    uint8_t u8() {
+        if (pos >= size) {
+            ok = false;
+            return 0;
+        }
+        return (uint8_t)data[pos++];
+    }
+
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t byte = u8();
+            if (!ok)
+                return 0;
+            // the tenth byte holds the last bit, more would overflow
+            if (shift == 63 && byte > 1)
+                break;
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                return value;
+        }
+        ok = false;
+        return 0;
+    }
+
+    // the string where it lies in the body
+    WireString view(size_t max) {
+        uint64_t length = varint();
+        if (!ok || length > max || length > size - pos) {
+            ok = false;
+            return WireString();
+        }
+        WireString value(data + pos, (size_t)length);
+        pos += (size_t)length;
+        return value;
+    }
+
+    // a string that has to be text: UTF-8 without a NUL, checked before
+    // anything looks at it
+    WireString text(size_t max) {
+        WireString value = view(max);
+        if (ok && !text_valid(value.data, value.size)) {
+            ok = false;
+            return WireString();
+        }
+        return value;
+    }
+
+    // the whole body was read and made sense
+    bool done() const { return ok && pos == size; }
+};
+
+// frame header, send this before send the message content
 struct MessageHeader {
     MessageType type;
+    uint32_t size;
+
+    MessageHeader() : type(MessageType::CLIENT_CONNECT), size(0) {}
+    MessageHeader(MessageType t, unsigned int s) : type(t), size(s) {}
 
-    MessageHeader() : type(MessageType::CLIENT_CONNECT) {}
-    MessageHeader(MessageType t, unsigned int s) : type(t) {}
+    // writes at most MAX_FRAME_HEADER bytes, returns how many
+    size_t encode(char* out) const {
+        size_t n = 0;
+        uint32_t value = size;
+        while (value >= 0x80) {
+            out[n++] = (char)((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        out[n++] = (char)value;
+        out[n++] = (char)(uint8_t)type;
+        return n;
+    }
+
+    // 1 and the header length once a whole header is available,
+    // 0 if more bytes are needed, -1 if the stream is broken
+    int decode(const char* data, size_t available, size_t& length) {
+        uint32_t value = 0;
+        for (size_t i = 0; i < 5; i++) {
+            if (i >= available)
+                return 0;
+            uint8_t byte = (uint8_t)data[i];
+            // the fifth byte holds the top 4 bits, more would overflow
+            if (i == 4 && byte > 0x0f)
+                return -1;
+            value |= (uint32_t)(byte & 0x7f) << (7 * i);
+            if (byte & 0x80)
+                continue;
+
+            if (value > MAX_FRAME_BODY)
+                return -1;
+            if (i + 1 >= available)
+                return 0;
+            size = value;
+            type = (MessageType)(uint8_t)data[i + 1];
+            length = i + 2;
+            return 1;
+        }
+        return -1;
+    }
 };
 
-struct ClientConnectMessage {
-    char username[32];
+// message schemas
+//
+// a message is a plain struct plus a WireSchema specialization that lists
+// its fields in wire order; writing, reading, the encoded size and the
+// checks are generated from that list, so a new message needs a struct and
+// a schema and nothing else
+//
+// the structs are templates over their string type: std::string for
+// messages that are built and sent, WireString for views that read a
+// received body in place; a view checks every length against the body once
+// when it is decoded and then points into it
+
+template <typename M>
+struct WireSchema;
+
+// the entries of a list field, still encoded, walked on demand
+template <typename E>
+struct WireList {
+    const char* data;
+    size_t size;
+    uint32_t count;
+
+    WireList() : data(nullptr), size(0), count(0) {}
+
+    // on_entry(entry) for every entry, in order
+    template <typename F>
+    void for_each(F&& on_entry) const;
+};
+
+// a list field holds a vector when the message owns its strings, a WireList
+// in a view
+template <typename S, typename E>
+struct ListOf {
+    typedef std::vector<E> type;
+};
+
+template <typename E>
+struct ListOf<WireString, E> {
+    typedef WireList<E> type;
+};
+
+inline size_t varint_size(uint64_t value)
+{
+    size_t n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+// field codecs, picked by the field's type; max caps strings
+
+inline void write_field(WireWriter& out, uint8_t value, size_t) { out.u8(value); }
+inline void write_field(WireWriter& out, uint32_t value, size_t) { out.varint(value); }
+inline void write_field(WireWriter& out, const std::string& value, size_t max) { out.str(value, max); }
+
+template <typename E>
+void write_field(WireWriter& out, const std::vector<E>& entries, size_t)
+{
+    out.varint(entries.size());
+    for (const E& entry : entries) {
+        WireSchema<E>::fields::write(out, entry);
+    }
+}
+
+inline void read_field(WireReader& in, uint8_t& value, size_t) { value = in.u8(); }
+inline void read_field(WireReader& in, uint32_t& value, size_t)
+{
+    // past 32 bits the body is broken, the value isn't cut down
+    uint64_t wide = in.varint();
+    if (wide > 0xffffffffu)
+        in.ok = false;
+    value = (uint32_t)wide;
+}
+inline void read_field(WireReader& in, std::string& value, size_t max) { value = in.text(max).str(); }
+inline void read_field(WireReader& in, WireString& value, size_t max) { value = in.text(max); }
 
-    ClientConnectMessage()
-    {
-        memset(username, 0, sizeof(username));
+// every field takes at least a byte, a count the rest of the body can't
+// hold is rejected before anything is read or allocated
+inline bool read_count(WireReader& in, size_t min_entry, uint32_t& count)
+{
+    uint64_t value = in.varint();
+    if (!in.ok || value > (in.size - in.pos) / min_entry) {
+        in.ok = false;
+        return false;
     }
+    count = (uint32_t)value;
+    return true;
+}
 
-    ClientConnectMessage(const std::string& name)
-    {
-        memset(username, 0, sizeof(username));
-        // safe copy, _TRUNCATE can add \0 atomicly
-        strncpy_s(username, sizeof(username), name.c_str(), _TRUNCATE);
+template <typename E>
+void read_field(WireReader& in, std::vector<E>& entries, size_t)
+{
+    uint32_t count = 0;
+    entries.clear();
+    if (!read_count(in, WireSchema<E>::fields::count, count))
+        return;
+    entries.resize(count);
+    for (uint32_t i = 0; i < count && in.ok; i++) {
+        WireSchema<E>::fields::read(in, entries[i]);
     }
+}
+
+// the entries are checked now and read again by for_each
+template <typename E>
+void read_field(WireReader& in, WireList<E>& entries, size_t)
+{
+    entries = WireList<E>();
+    if (!read_count(in, WireSchema<E>::fields::count, entries.count))
+        return;
+    entries.data = in.data + in.pos;
+    for (uint32_t i = 0; i < entries.count && in.ok; i++) {
+        E entry;
+        WireSchema<E>::fields::read(in, entry);
+    }
+    entries.size = in.data + in.pos - entries.data;
+}
+
+inline size_t field_size(uint8_t, size_t) { return 1; }
+inline size_t field_size(uint32_t value, size_t) { return varint_size(value); }
+
+inline size_t field_size(const std::string& value, size_t max)
+{
+    // an upper bound when str() has to cut the string
+    size_t size = value.size() < max ? value.size() : max;
+    return varint_size(size) + size;
+}
+
+template <typename E>
+size_t field_size(const std::vector<E>& entries, size_t)
+{
+    size_t size = varint_size(entries.size());
+    for (const E& entry : entries) {
+        size += WireSchema<E>::fields::size(entry);
+    }
+    return size;
+}
+
+// one field of M: its type, where it is, and the string cap
+template <typename M, typename T, T M::*member, size_t max = 0>
+struct Field {
+    static void write(WireWriter& out, const M& message) { write_field(out, message.*member, max); }
+    static void read(WireReader& in, M& message) { read_field(in, message.*member, max); }
+    static size_t size(const M& message) { return field_size(message.*member, max); }
 };
 
-struct PublicMessage {
-    char sender[32];
-    char content[256];
+// the fields in wire order; each operation is one straight run over them
+template <typename... F>
+struct Fields {
+    static const size_t count = sizeof...(F);
+
+    template <typename M>
+    static void write(WireWriter& out, const M& message) {
+        int expand[] = { 0, (F::write(out, message), 0)... };
+        (void)expand;
+    }
 
-    PublicMessage() {
-        memset(sender, 0, sizeof(sender));
-        memset(content, 0, sizeof(content));
+    // after a failed read the rest reads as zero/empty and in.ok stays false
+    template <typename M>
+    static void read(WireReader& in, M& message) {
+        int expand[] = { 0, (F::read(in, message), 0)... };
+        (void)expand;
     }
 
-    PublicMessage(const std::string& s, const std::string& c) {
-        memset(sender, 0, sizeof(sender));
-        memset(content, 0, sizeof(content));
-        strncpy_s(sender, sizeof(sender), s.c_str(), _TRUNCATE);
-        strncpy_s(content, sizeof(content), c.c_str(), _TRUNCATE);
+    template <typename M>
+    static size_t size(const M& message) {
+        size_t total = 0;
+        int expand[] = { 0, (total += F::size(message), 0)... };
+        (void)expand;
+        return total;
     }
 };
 
-struct PrivateMessage {
-    char sender[32];
-    char target[32];
-    char content[256];
+template <typename E>
+template <typename F>
+void WireList<E>::for_each(F&& on_entry) const
+{
+    WireReader in(data, size);
+    for (uint32_t i = 0; i < count; i++) {
+        E entry;
+        WireSchema<E>::fields::read(in, entry);
+        on_entry(entry);
+    }
+}
+
+// what a decoded body must look like beyond its fields: all of it read
+struct ExactBody {
+    template <typename M>
+    static bool check(const M&, const WireReader& in) { return in.done(); }
+};
 
-    PrivateMessage() {
-        memset(sender, 0, sizeof(sender));
-        memset(target, 0, sizeof(target));
-        memset(content, 0, sizeof(content));
+// a newer peer may add fields at the end
+struct ExtensibleBody {
+    template <typename M>
+    static bool check(const M&, const WireReader& in) { return in.ok; }
+};
+
+template <typename S>
+struct BasicClientConnect {
+    uint8_t version;
+    uint32_t capabilities;
+    S username;
+
+    BasicClientConnect() : version(PROTOCOL_VERSION), capabilities(0) {}
+    BasicClientConnect(const S& name, uint32_t caps) : version(PROTOCOL_VERSION), capabilities(caps), username(name) {}
+};
+
+typedef BasicClientConnect<std::string> ClientConnectMessage;
+typedef BasicClientConnect<WireString> ClientConnectView;
+
+template <typename S>
+struct WireSchema<BasicClientConnect<S>> {
+    typedef BasicClientConnect<S> M;
+    static const MessageType type = MessageType::CLIENT_CONNECT;
+    typedef Fields<
+        Field<M, uint8_t, &M::version>,
+        Field<M, uint32_t, &M::capabilities>,
+        Field<M, S, &M::username, MAX_NAME_LENGTH>
+    > fields;
+
+    // a newer client may send more after these
+    static bool check(const M& message, const WireReader& in) {
+        if (message.version < MIN_PROTOCOL_VERSION)
+            return false;
+        return message.version > PROTOCOL_VERSION ? in.ok : in.done();
     }
+};
+
+// the user's id, and the version and capabilities the connection uses
+struct ClientAcceptedMessage {
+    uint32_t user_id;
+    uint8_t version;
+    uint32_t capabilities;
+
+    ClientAcceptedMessage() : user_id(0), version(PROTOCOL_VERSION), capabilities(0) {}
+    ClientAcceptedMessage(uint32_t id, uint8_t v, uint32_t caps) : user_id(id), version(v), capabilities(caps) {}
+};
+
+template <>
+struct WireSchema<ClientAcceptedMessage> : ExtensibleBody {
+    typedef ClientAcceptedMessage M;
+    static const MessageType type = MessageType::CLIENT_ACCEPTED;
+    typedef Fields<
+        Field<M, uint32_t, &M::user_id>,
+        Field<M, uint8_t, &M::version>,
+        Field<M, uint32_t, &M::capabilities>
+    > fields;
+};
+
+template <typename S>
+struct BasicPublicMessage {
+    uint32_t sender;
+    S content;
+
+    BasicPublicMessage() : sender(0) {}
+    BasicPublicMessage(uint32_t s, const S& c) : sender(s), content(c) {}
+};
+
+typedef BasicPublicMessage<std::string> PublicMessage;
+typedef BasicPublicMessage<WireString> PublicMessageView;
 
-    PrivateMessage(const std::string& s, const std::string& t, const std::string& c) {
-        memset(sender, 0, sizeof(sender));
-        memset(target, 0, sizeof(target));
-        memset(content, 0, sizeof(content));
-        strncpy_s(sender, sizeof(sender), s.c_str(), _TRUNCATE);
-        strncpy_s(target, sizeof(target), t.c_str(), _TRUNCATE);
-        strncpy_s(content, sizeof(content), c.c_str(), _TRUNCATE);
+template <typename S>
+struct WireSchema<BasicPublicMessage<S>> : ExactBody {
+    typedef BasicPublicMessage<S> M;
+    static const MessageType type = MessageType::PUBLIC_MESSAGE;
+    typedef Fields<
+        Field<M, uint32_t, &M::sender>,
+        Field<M, S, &M::content, MAX_TEXT_LENGTH>
+    > fields;
+};
+
+template <typename S>
+struct BasicPrivateMessage {
+    uint32_t sender;
+    uint32_t target;
+    S content;
+
+    BasicPrivateMessage() : sender(0), target(0) {}
+    BasicPrivateMessage(uint32_t s, uint32_t t, const S& c) : sender(s), target(t), content(c) {}
+};
+
+typedef BasicPrivateMessage<std::string> PrivateMessage;
+typedef BasicPrivateMessage<WireString> PrivateMessageView;
+
+template <typename S>
+struct WireSchema<BasicPrivateMessage<S>> : ExactBody {
+    typedef BasicPrivateMessage<S> M;
+    static const MessageType type = MessageType::PRIVATE_MESSAGE;
+    typedef Fields<
+        Field<M, uint32_t, &M::sender>,
+        Field<M, uint32_t, &M::target>,
+        Field<M, S, &M::content, MAX_TEXT_LENGTH>
+    > fields;
+};
+
+inline size_t string_size(const std::string& value) { return value.size(); }
+inline size_t string_size(const WireString& value) { return value.size; }
+
+// PUBLIC_FRAGMENT / PRIVATE_FRAGMENT
+// text over MAX_TEXT_LENGTH goes out in pieces of up to MAX_TEXT_LENGTH
+// bytes, each cut where a UTF-8 sequence starts; total is the length of the
+// whole text and offset where the piece goes in it. stream numbers the
+// sender's long messages, pieces of one stream come in order and a receiver
+// that misses one drops the text. the server forwards pieces as they come,
+// it never holds a whole text
+struct FragmentBody {
+    template <typename M>
+    static bool check(const M& message, const WireReader& in) {
+        size_t size = string_size(message.chunk);
+        return in.done() && size > 0 && message.total <= MAX_FRAGMENTED_TEXT
+            && message.offset <= message.total && size <= message.total - message.offset;
     }
 };
 
+template <typename S>
+struct BasicPublicFragment {
+    uint32_t sender;
+    uint32_t stream;
+    uint32_t total;
+    uint32_t offset;
+    S chunk;
+
+    BasicPublicFragment() : sender(0), stream(0), total(0), offset(0) {}
+    BasicPublicFragment(uint32_t s, uint32_t st, uint32_t t, uint32_t o, const S& c)
+        : sender(s), stream(st), total(t), offset(o), chunk(c) {}
+};
+
+typedef BasicPublicFragment<std::string> PublicFragment;
+typedef BasicPublicFragment<WireString> PublicFragmentView;
+
+template <typename S>
+struct WireSchema<BasicPublicFragment<S>> : FragmentBody {
+    typedef BasicPublicFragment<S> M;
+    static const MessageType type = MessageType::PUBLIC_FRAGMENT;
+    typedef Fields<
+        Field<M, uint32_t, &M::sender>,
+        Field<M, uint32_t, &M::stream>,
+        Field<M, uint32_t, &M::total>,
+        Field<M, uint32_t, &M::offset>,
+        Field<M, S, &M::chunk, MAX_TEXT_LENGTH>
+    > fields;
+};
+
+template <typename S>
+struct BasicPrivateFragment {
+    uint32_t sender;
+    uint32_t target;
+    uint32_t stream;
+    uint32_t total;
+    uint32_t offset;
+    S chunk;
+
+    BasicPrivateFragment() : sender(0), target(0), stream(0), total(0), offset(0) {}
+    BasicPrivateFragment(uint32_t s, uint32_t t, uint32_t st, uint32_t tl, uint32_t o, const S& c)
+        : sender(s), target(t), stream(st), total(tl), offset(o), chunk(c) {}
+};
+
+typedef BasicPrivateFragment<std::string> PrivateFragment;
+typedef BasicPrivateFragment<WireString> PrivateFragmentView;
+
+template <typename S>
+struct WireSchema<BasicPrivateFragment<S>> : FragmentBody {
+    typedef BasicPrivateFragment<S> M;
+    static const MessageType type = MessageType::PRIVATE_FRAGMENT;
+    typedef Fields<
+        Field<M, uint32_t, &M::sender>,
+        Field<M, uint32_t, &M::target>,
+        Field<M, uint32_t, &M::stream>,
+        Field<M, uint32_t, &M::total>,
+        Field<M, uint32_t, &M::offset>,
+        Field<M, S, &M::chunk, MAX_TEXT_LENGTH>
+    > fields;
+};
+
+// where the piece of text starting at offset ends
+inline size_t fragment_end(const std::string& text, size_t offset)
+{
+    return offset + utf8_prefix(text.data() + offset, text.size() - offset, MAX_TEXT_LENGTH);
+}
+
+template <typename S>
+struct BasicUserEntry {
+    uint32_t id;
+    S name;
+};
+
+typedef BasicUserEntry<std::string> UserEntry;
+typedef BasicUserEntry<WireString> UserEntryView;
+
+template <typename S>
+struct WireSchema<BasicUserEntry<S>> {
+    typedef BasicUserEntry<S> M;
+    typedef Fields<
+        Field<M, uint32_t, &M::id>,
+        Field<M, S, &M::name, MAX_NAME_LENGTH>
+    > fields;
+};
+
 // user list
-struct UserListMessage {
-    int user_count;
-    char users[32][32];
-
-    UserListMessage() {
-        user_count = 0;
-        for (int i = 0; i < 32; i++) {
-            memset(users[i], 0, sizeof(users[i]));
-        }
-    }
+// one page of the list the server had at presence version, the list holds
+// total users and this page starts at offset
+template <typename S>
+struct BasicUserList {
+    typedef typename ListOf<S, BasicUserEntry<S>>::type Users;
+
+    uint32_t version;
+    uint32_t total;
+    uint32_t offset;
+    Users users;
+
+    BasicUserList() : version(0), total(0), offset(0) {}
+};
+
+typedef BasicUserList<std::string> UserListMessage;
+typedef BasicUserList<WireString> UserListView;
+
+template <typename S>
+struct WireSchema<BasicUserList<S>> : ExactBody {
+    typedef BasicUserList<S> M;
+    static const MessageType type = MessageType::USER_LIST_UPDATE;
+    typedef Fields<
+        Field<M, uint32_t, &M::version>,
+        Field<M, uint32_t, &M::total>,
+        Field<M, uint32_t, &M::offset>,
+        Field<M, typename M::Users, &M::users>
+    > fields;
 };
+
+// the page at offset of the list at version, version 0 asks for a new list
+struct UserListRequest {
+    uint32_t version;
+    uint32_t offset;
+
+    UserListRequest() : version(0), offset(0) {}
+    UserListRequest(uint32_t v, uint32_t o) : version(v), offset(o) {}
+};
+
+template <>
+struct WireSchema<UserListRequest> : ExactBody {
+    typedef UserListRequest M;
+    static const MessageType type = MessageType::USER_LIST_REQUEST;
+    typedef Fields<
+        Field<M, uint32_t, &M::version>,
+        Field<M, uint32_t, &M::offset>
+    > fields;
+};
+
+// USER_JOINED / USER_LEFT
+// the server counts every join and leave and sends them in batches, a change
+// applies on top of base_version and brings the list to version, a client
+// whose list is at another version has missed something and asks for the
+// full list; a join carries the name for the id, a leave only the id
+// one struct for both types, so the schema has no type of its own
+template <typename S>
+struct BasicPresence {
+    uint32_t base_version;
+    uint32_t version;
+    uint32_t user_id;
+    S username;
+
+    BasicPresence() : base_version(0), version(0), user_id(0) {}
+    BasicPresence(uint32_t base, uint32_t v, uint32_t id, const S& name)
+        : base_version(base), version(v), user_id(id), username(name) {}
+};
+
+typedef BasicPresence<std::string> PresenceMessage;
+typedef BasicPresence<WireString> PresenceView;
+
+template <typename S>
+struct WireSchema<BasicPresence<S>> : ExactBody {
+    typedef BasicPresence<S> M;
+    typedef Fields<
+        Field<M, uint32_t, &M::base_version>,
+        Field<M, uint32_t, &M::version>,
+        Field<M, uint32_t, &M::user_id>,
+        Field<M, S, &M::username, MAX_NAME_LENGTH>
+    > fields;
+};
+
+// the type a message goes out as
+template <typename M>
+MessageType message_type(const M&)
+{
+    return WireSchema<M>::type;
+}
+
+// encoded size of a message body, exact unless a string gets cut
+template <typename M>
+size_t encoded_size(const M& message)
+{
+    return WireSchema<M>::fields::size(message);
+}
+
+// encoded body of any message above
+template <typename M>
+std::vector<char> encode_message(const M& message)
+{
+    WireWriter out;
+    out.bytes.reserve(encoded_size(message));
+    WireSchema<M>::fields::write(out, message);
+    return out.bytes;
+}
+
+// call on_frame(type, body, size) for every frame in a batch body,
+// false if the frames don't fill the body exactly
+template <typename F>
+bool for_each_frame(const char* data, size_t size, F&& on_frame)
+{
+    size_t pos = 0;
+    while (pos < size) {
+        MessageHeader header;
+        size_t length = 0;
+        if (header.decode(data + pos, size - pos, length) != 1 || header.size > size - pos - length)
+            return false;
+        pos += length;
+        on_frame(header.type, data + pos, header.size);
+        pos += header.size;
+    }
+    return true;
+}
+
+// decode a body into message or view, false if it doesn't parse
+template <typename M>
+bool decode_message(const char* body, size_t size, M& message)
+{
+    WireReader in(body, size);
+    WireSchema<M>::fields::read(in, message);
+    return in.ok && WireSchema<M>::check(message, in);
+}
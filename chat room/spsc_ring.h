@@ -0,0 +1,55 @@
+﻿#pragma once
+// a bounded queue between one producer thread and one consumer thread, no
+// locks: each side only writes its own index and reads the other's
+//
+// the slots are built once and reused, an item is filled in place by the
+// producer and read in place by the consumer, so the strings and vectors in
+// a slot keep their capacity from one item to the next
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity) : slots(capacity), head(0), tail(0) {}
+
+    // producer: the slot to fill next, null while the ring is full; it
+    // becomes visible with publish()
+    T* claim() {
+        size_t at = tail.load(std::memory_order_relaxed);
+        if (at - head.load(std::memory_order_acquire) == slots.size())
+            return nullptr;
+        return &slots[at % slots.size()];
+    }
+
+    void publish() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // consumer: the oldest item, null while the ring is empty; the slot is
+    // handed back with pop()
+    T* front() {
+        return peek(0);
+    }
+
+    // the item n places behind the oldest, null if fewer are waiting
+    T* peek(size_t n) {
+        size_t at = head.load(std::memory_order_relaxed);
+        if (tail.load(std::memory_order_acquire) - at <= n)
+            return nullptr;
+        return &slots[(at + n) % slots.size()];
+    }
+
+    // hands back the count oldest slots at once
+    void pop(size_t count = 1) {
+        head.store(head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+private:
+    std::vector<T> slots;
+    // the indexes only grow, each on its own cache line so the two threads
+    // don't keep taking the line from each other
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
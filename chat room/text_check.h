@@ -0,0 +1,94 @@
+﻿#pragma once
+// checks on the strings read off the wire
+//
+// names and messages end up on the console, in ImGui and in C strings on the
+// client, so every string has to be UTF-8 without a NUL; chat is mostly
+// ASCII, so the check looks at 16 bytes at a time with SSE2 while they are
+// plain ASCII and decodes the rest one sequence at a time
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TEXT_CHECK_SSE2 1
+#endif
+
+// length of the UTF-8 sequence at p, 0 if it isn't a valid one or is a NUL;
+// overlong forms, surrogates and values past U+10FFFF are not valid
+inline size_t utf8_sequence(const unsigned char* p, size_t left)
+{
+    unsigned char lead = p[0];
+    if (lead < 0x80)
+        return lead != 0 ? 1 : 0;
+
+    size_t length;
+    uint32_t value;
+    uint32_t min;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+        value = lead & 0x1F;
+        min = 0x80;
+    }
+    else if ((lead & 0xF0) == 0xE0) {
+        length = 3;
+        value = lead & 0x0F;
+        min = 0x800;
+    }
+    else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        value = lead & 0x07;
+        min = 0x10000;
+    }
+    else {
+        return 0;
+    }
+    if (length > left)
+        return 0;
+
+    for (size_t i = 1; i < length; i++) {
+        if ((p[i] & 0xC0) != 0x80)
+            return 0;
+        value = (value << 6) | (p[i] & 0x3F);
+    }
+    if (value < min || value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF))
+        return 0;
+    return length;
+}
+
+// sequence by sequence over [from, to), a sequence may run past to but not
+// past size; where it ended, or 0 if something wasn't valid
+inline size_t utf8_check_run(const unsigned char* p, size_t from, size_t to, size_t size)
+{
+    while (from < to) {
+        size_t length = utf8_sequence(p + from, size - from);
+        if (length == 0)
+            return 0;
+        from += length;
+    }
+    return from;
+}
+
+// true if data is UTF-8 without a NUL
+inline bool text_valid(const char* data, size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    size_t pos = 0;
+
+#ifdef TEXT_CHECK_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    while (pos + 16 <= size) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(p + pos));
+        // the top bit marks bytes past ASCII, the compare marks NULs
+        int flagged = _mm_movemask_epi8(chunk) | _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+        if (flagged == 0) {
+            pos += 16;
+            continue;
+        }
+        pos = utf8_check_run(p, pos, pos + 16, size);
+        if (pos == 0)
+            return false;
+    }
+#endif
+
+    return size == 0 || utf8_check_run(p, pos, size, size) != 0;
+}
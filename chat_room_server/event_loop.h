@@ -0,0 +1,235 @@
+﻿#pragma once
+// edge-triggered epoll reactor, linux only
+// one thread owns a listen socket and the sessions accepted on it, a session
+// is only ever read, parsed and closed on this thread
+#ifdef __linux__
+#include "session.h"
+#include "reactor.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unordered_map>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <iostream>
+
+class EpollReactor : public Reactor {
+public:
+    SessionHandler* handler;
+    SOCKET listen_socket;
+    int epoll_fd;
+    int wake_fd;
+    std::unordered_map<SOCKET, std::shared_ptr<Session>> sessions;
+    // sessions with queued output, written after the current batch of events
+    std::vector<std::shared_ptr<Session>> flush_list;
+    // sessions to close after the current batch of events
+    std::vector<std::shared_ptr<Session>> close_list;
+
+    EpollReactor() : handler(nullptr), listen_socket(INVALID_SOCKET), epoll_fd(-1), wake_fd(-1)
+    {}
+
+    ~EpollReactor() {
+        stop();
+        // closed last, other reactors may still wake this one while they stop
+        if (wake_fd >= 0)
+            ::close(wake_fd);
+        if (epoll_fd >= 0)
+            ::close(epoll_fd);
+    }
+
+    bool start(SOCKET listener, SessionHandler* h, int shard) {
+        index = shard;
+        handler = h;
+        listen_socket = listener;
+
+        if (!set_nonblocking(listen_socket)) {
+            std::cerr << "Failed to make listen socket non-blocking" << std::endl;
+            return false;
+        }
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd < 0 || wake_fd < 0) {
+            std::cerr << "epoll setup failed" << std::endl;
+            return false;
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = listen_socket;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_socket, &ev);
+
+        ev.events = EPOLLIN;
+        ev.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+        return true;
+    }
+
+    void stop() override {
+        if (!running.exchange(false))
+            return;
+
+        wake();
+
+        if (loop_thread.joinable())
+            loop_thread.join();
+
+        for (auto& entry : sessions) {
+            closesocket(entry.first);
+        }
+        sessions.clear();
+    }
+
+    void wake() override {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {}
+    }
+
+    // ask the loop to close a session once it finishes the current batch
+    // must be called on the loop thread
+    void defer_close(const std::shared_ptr<Session>& session) override {
+        session->closing = true;
+        close_list.push_back(session);
+    }
+
+    void schedule_flush(const std::shared_ptr<Session>& session) override {
+        flush_list.push_back(session);
+    }
+
+    void run() override {
+        enter_loop();
+        std::vector<epoll_event> events(256);
+
+        while (running) {
+            // work other shards posted, and the output and closes it caused
+            run_mailbox();
+            settle();
+
+            int count = epoll_wait(epoll_fd, events.data(), (int)events.size(), -1);
+            if (count < 0) {
+                if (errno == EINTR)
+                    continue;
+                std::cerr << "epoll_wait failed" << std::endl;
+                break;
+            }
+
+            for (int i = 0; i < count; i++) {
+                int fd = events[i].data.fd;
+                uint32_t flags = events[i].events;
+
+                if (fd == wake_fd) {
+                    uint64_t value;
+                    if (read(wake_fd, &value, sizeof(value)) < 0) {}
+                    continue;
+                }
+
+                if (fd == listen_socket) {
+                    accept_all();
+                    continue;
+                }
+
+                auto it = sessions.find(fd);
+                if (it == sessions.end())
+                    continue;
+                std::shared_ptr<Session> session = it->second;
+                if (session->closing)
+                    continue;
+
+                if (flags & EPOLLOUT) {
+                    if (!session->flush()) {
+                        defer_close(session);
+                        continue;
+                    }
+                }
+
+                if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    // edge triggered: drain the socket completely before parsing
+                    bool alive = session->read_available();
+                    handler->on_session_data(session);
+                    if (!alive || (flags & (EPOLLHUP | EPOLLERR)))
+                        defer_close(session);
+                }
+            }
+
+            settle();
+
+            // the batch filled the array, the next one may be bigger
+            if (count == (int)events.size())
+                events.resize(events.size() * 2);
+        }
+    }
+
+    void accept_all() {
+        while (true) {
+            sockaddr_in client_address;
+            socklen_t len = sizeof(client_address);
+
+            SOCKET client_socket = accept4(listen_socket, (sockaddr*)&client_address, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_socket == INVALID_SOCKET) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if (!socket_would_block(errno))
+                    std::cerr << "Accept failed" << std::endl;
+                return;
+            }
+
+            int nodelay = 1;
+            setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+            std::shared_ptr<Session> session = std::make_shared<Session>(client_socket);
+            session->owner = this;
+            sessions[client_socket] = session;
+
+            // register for both directions once, edge triggering means
+            // EPOLLOUT only fires when the send buffer drains
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.fd = client_socket;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev);
+        }
+    }
+
+    // one gathered write per session for everything the batch queued,
+    // sessions about to close get their last messages out too
+    void flush_pending() {
+        for (size_t i = 0; i < flush_list.size(); i++) {
+            std::shared_ptr<Session> session = flush_list[i];
+            bool ok;
+            {
+                std::lock_guard<std::mutex> lock(session->send_mutex);
+                session->flush_scheduled = false;
+                ok = session->flush_locked();
+            }
+            if (!ok)
+                defer_close(session);
+        }
+        flush_list.clear();
+    }
+
+    // closing a session broadcasts, which queues output that can fail and
+    // close more sessions, keep going until both lists stay empty
+    void settle() {
+        while (!flush_list.empty() || !close_list.empty()) {
+            flush_pending();
+            close_deferred();
+        }
+    }
+
+    void close_deferred() {
+        // on_session_close can broadcast and fail more sends, which appends here
+        for (size_t i = 0; i < close_list.size(); i++) {
+            std::shared_ptr<Session> session = close_list[i];
+            auto it = sessions.find(session->socket);
+            if (it == sessions.end() || it->second != session)
+                continue;
+
+            sessions.erase(it);
+            handler->on_session_close(session);
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->socket, nullptr);
+            closesocket(session->socket);
+        }
+        close_list.clear();
+    }
+};
+#endif
@@ -1,71 +1,214 @@
-﻿#include <winsock2.h>
-#include <ws2tcpip.h>
+﻿#include "platform.h"
 #include <iostream>
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <unordered_map>
 #include <string>
 #include <algorithm>
+#include <condition_variable>
+#include <chrono>
 #include "net_protocol.h"
+#include "session.h"
+#include "presence.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+
+// what this server offers, a connection gets the part its client asks for
+const uint32_t SERVER_CAPABILITIES = CAP_BATCH | CAP_PRESENCE_DELTA | CAP_COMPRESSION | CAP_FRAGMENTS;
+
+// how client sockets are driven
+enum class ServerBackend {
+    BLOCKING,   // one thread per client, blocking recv/send
+    EPOLL,      // edge-triggered epoll reactors, one per core (linux)
+    IO_URING,   // io_uring reactors with multishot accept/recv (linux)
+};
+
+// every joined user, by socket and by name, both always change together
+struct ClientTable {
+    std::unordered_map<SOCKET, std::shared_ptr<Session>> by_socket;
+    std::unordered_map<std::string, std::shared_ptr<Session>> by_name;
+    // chat frames name users by id, the server routes on it too
+    std::unordered_map<uint32_t, std::shared_ptr<Session>> by_id;
+    // presence version, counts every join and leave
+    uint32_t version;
+
+    ClientTable() : version(0) {}
+
+    bool empty() const { return by_socket.empty(); }
+
+    std::shared_ptr<Session> find(uint32_t user_id) const {
+        auto it = by_id.find(user_id);
+        return it == by_id.end() ? nullptr : it->second;
+    }
+
+    // false if the name is taken
+    bool add(const std::shared_ptr<Session>& session) {
+        if (!by_name.emplace(session->username, session).second)
+            return false;
+        by_socket[session->socket] = session;
+        by_id[session->user_id] = session;
+        version++;
+        return true;
+    }
+
+    void remove(const std::shared_ptr<Session>& session) {
+        auto it = by_name.find(session->username);
+        if (it != by_name.end() && it->second == session)
+            by_name.erase(it);
+        by_socket.erase(session->socket);
+        by_id.erase(session->user_id);
+        version++;
+    }
 
-#pragma comment(lib, "ws2_32.lib")
+    void clear() {
+        by_socket.clear();
+        by_name.clear();
+        by_id.clear();
+    }
+};
 
-class ChatServer {
+class ChatServer : public SessionHandler {
 public:
     SOCKET server_socket;
-    std::unordered_map<SOCKET, std::string> clients;
+    // copy-on-write: readers take the current snapshot without locking,
+    // join/leave copy it under clients_mutex and publish the copy
+    std::shared_ptr<const ClientTable> clients;
     std::mutex clients_mutex;
-    bool running;
+    std::atomic<bool> running;
+    ServerBackend backend;
+    // send queue limits and what they did
+    Backpressure backpressure;
+
+    // joins and leaves not sent yet, guarded by clients_mutex
+    std::vector<PresenceChange> presence_log;
+    // how long changes are collected before they go out
+    int presence_window_ms;
+    // presence version the last window ended at, set once the window is
+    // sent or posted to every reactor
+    std::atomic<uint32_t> presence_sent;
+    // one window goes out at a time, the presence thread or a chat message
+    // from a user whose join hasn't gone out yet sends it
+    std::mutex presence_flush_mutex;
+    std::thread presence_thread;
+    std::mutex presence_mutex;
+    std::condition_variable presence_wake;
+    // the next user id, ids aren't reused
+    std::atomic<uint32_t> next_user_id;
+
+    // reactor mode: every reactor owns a SO_REUSEPORT listener on the same
+    // port and the sessions the kernel hands to it
+    std::vector<std::unique_ptr<Reactor>> reactors;
+    std::vector<SOCKET> listen_sockets;
 
     //std::vector<std::thread> client_threads;
 
-    ChatServer() : server_socket(INVALID_SOCKET), running(false) 
+    ChatServer() : server_socket(INVALID_SOCKET), clients(std::make_shared<const ClientTable>()),
+        running(false), backend(ServerBackend::BLOCKING), presence_window_ms(50), presence_sent(0), next_user_id(SYSTEM_USER_ID + 1)
     {}
 
-    bool init(int port) {
+    // the table as of now, never changes while the caller holds it
+    std::shared_ptr<const ClientTable> client_snapshot() {
+        return std::atomic_load(&clients);
+    }
 
-        // Step 1: Initialize WinSock
-        WSADATA wsaData;
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-            std::cerr << "WSAStartup failed with error: " << WSAGetLastError() << std::endl;
+    // apply change to a copy of the table and publish it,
+    // nothing changes if change returns false
+    template <typename F>
+    bool update_clients(F&& change) {
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        std::shared_ptr<ClientTable> next = std::make_shared<ClientTable>(*client_snapshot());
+        if (!change(*next))
             return false;
-        }
+        std::atomic_store(&clients, std::shared_ptr<const ClientTable>(std::move(next)));
+        return true;
+    }
 
+    // create, bind and listen, INVALID_SOCKET on failure
+    SOCKET open_listener(int port, bool reuse_port) {
         // create socket
-        server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (server_socket == INVALID_SOCKET) 
+        SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener == INVALID_SOCKET)
         {
             std::cerr << "Socket creation failed" << std::endl;
-            WSACleanup();
-            return false;
+            return INVALID_SOCKET;
         }
 
+#ifndef _WIN32
+        // allow a quick restart while old connections sit in TIME_WAIT
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
+#ifdef SO_REUSEPORT
+        // several listeners on one port, the kernel spreads connections over them
+        if (reuse_port)
+            setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+#endif
+
         // bind port and address
         sockaddr_in serverAddr;
         serverAddr.sin_family = AF_INET;
         serverAddr.sin_port = htons(port);
         serverAddr.sin_addr.s_addr = INADDR_ANY;
 
-        if (bind(server_socket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) 
+        if (bind(listener, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR)
         {
             std::cerr << "Bind failed" << std::endl;
-            closesocket(server_socket);
-            WSACleanup();
-            return false;
+            closesocket(listener);
+            return INVALID_SOCKET;
         }
 
-        if (listen(server_socket, SOMAXCONN) == SOCKET_ERROR) 
+        if (listen(listener, SOMAXCONN) == SOCKET_ERROR)
         {
             std::cerr << "Listen failed" << std::endl;
-            closesocket(server_socket);
-            WSACleanup();
+            closesocket(listener);
+            return INVALID_SOCKET;
+        }
+
+        return listener;
+    }
+
+    bool init(int port, ServerBackend mode, int threads) {
+
+        // Step 1: Initialize WinSock
+        if (!socket_startup()) {
+            std::cerr << "WSAStartup failed with error: " << socket_error() << std::endl;
             return false;
         }
 
         running = true;
+        backend = mode;
+
+#ifdef __linux__
+        if (backend != ServerBackend::BLOCKING) {
+            if (!start_reactors(port, threads)) {
+                running = false;
+                socket_cleanup();
+                return false;
+            }
+            std::cout << "Chat Server started on port " << port
+                << (backend == ServerBackend::IO_URING ? " (io_uring, " : " (epoll, ")
+                << reactors.size() << " reactors)" << std::endl;
+            presence_thread = std::thread(&ChatServer::presence_loop, this);
+            return true;
+        }
+#else
+        backend = ServerBackend::BLOCKING;
+#endif
+
+        server_socket = open_listener(port, false);
+        if (server_socket == INVALID_SOCKET) {
+            running = false;
+            socket_cleanup();
+            return false;
+        }
+
         std::cout << "Chat Server started on port " << port << std::endl;
 
+        presence_thread = std::thread(&ChatServer::presence_loop, this);
+
         std::thread acceptThread(&ChatServer::accept_client, this);
         // detach thread, when close the server, the while loop
         // in thread will break, thread will be release
@@ -74,40 +217,104 @@ public:
         return true;
     }
 
+#ifdef __linux__
+    bool start_reactors(int port, int threads) {
+        for (int i = 0; i < threads; i++) {
+            SOCKET listener = open_listener(port, true);
+            if (listener == INVALID_SOCKET) {
+                stop_reactors();
+                return false;
+            }
+            listen_sockets.push_back(listener);
+
+            if (backend == ServerBackend::IO_URING) {
+                std::unique_ptr<UringReactor> uring(new UringReactor());
+                if (uring->start(listener, this, i)) {
+                    reactors.push_back(std::move(uring));
+                    continue;
+                }
+                // kernel without io_uring (or it is disabled), use epoll instead
+                if (i > 0) {
+                    stop_reactors();
+                    return false;
+                }
+                std::cerr << "io_uring unavailable, falling back to epoll" << std::endl;
+                backend = ServerBackend::EPOLL;
+            }
+
+            std::unique_ptr<EpollReactor> reactor(new EpollReactor());
+            if (!reactor->start(listener, this, i)) {
+                stop_reactors();
+                return false;
+            }
+            reactors.push_back(std::move(reactor));
+        }
+
+        // loops start once the reactor list is final, they all read it
+        for (auto& reactor : reactors) {
+            reactor->launch();
+        }
+        return true;
+    }
+#endif
+
+    void stop_reactors() {
+        for (auto& reactor : reactors) {
+            reactor->stop();
+        }
+        reactors.clear();
+
+        for (SOCKET listener : listen_sockets) {
+            closesocket(listener);
+        }
+        listen_sockets.clear();
+    }
+
     void close() {
-        running = false;
+        {
+            std::lock_guard<std::mutex> lock(presence_mutex);
+            running = false;
+        }
+        presence_wake.notify_all();
+        // it posts to the reactors, so it goes first
+        if (presence_thread.joinable())
+            presence_thread.join();
+
+        // the reactors own the sockets in epoll/io_uring mode, stop them first
+        stop_reactors();
 
         // close  linsten socket
-        if (server_socket != INVALID_SOCKET) 
+        if (server_socket != INVALID_SOCKET)
         {
             closesocket(server_socket);
             server_socket = INVALID_SOCKET;
         }
 
         // close all clients
-        {
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            for (auto& client : clients) 
+        std::shared_ptr<const ClientTable> table = client_snapshot();
+        if (backend == ServerBackend::BLOCKING) {
+            for (auto& client : table->by_socket)
             {
-                closesocket(client.first);
+                shutdown(client.first, SHUT_RDWR);
             }
-            clients.clear();
         }
+        update_clients([](ClientTable& all) { all.clear(); return true; });
 
-        WSACleanup();
+        socket_cleanup();
+        print_stats();
         std::cout << "Server stopp" << std::endl;
     }
 
-    void accept_client() 
+    void accept_client()
     {
         while (running) {
             sockaddr_in client_address;
-            int len = sizeof(client_address);
+            socklen_t len = sizeof(client_address);
 
             SOCKET client_socket = accept(server_socket, (sockaddr*)&client_address, &len);
-            if (client_socket == INVALID_SOCKET) 
+            if (client_socket == INVALID_SOCKET)
             {
-                if (running) 
+                if (running)
                     std::cerr << "Accept failed" << std::endl;
                 continue;
             }
@@ -117,232 +324,597 @@ public:
             std::cout << "Accept connection from: " << clientIP << ":" << ntohs(client_address.sin_port) << std::endl;
 
             // create client thread
-            std::thread clientThread(&ChatServer::handle_client, this, client_socket);
+            std::shared_ptr<Session> session = std::make_shared<Session>(client_socket);
+            std::thread clientThread(&ChatServer::handle_client, this, session);
             clientThread.detach();
         }
     }
 
-    void broadcast_userlist() {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        // if no user
-        if (clients.empty()) 
-            return;
-
-        UserListMessage user_list;
-        user_list.user_count = 0;
+    // blocking backend: this thread reads the socket and feeds the session
+    // the socket is non-blocking so a sender never waits on a slow peer,
+    // output the kernel did not take is written here once it drains
+    void handle_client(std::shared_ptr<Session> session) {
+        set_nonblocking(session->socket);
 
-        // collect all user name
-        for (const auto& client : clients) 
-        {
-            if (user_list.user_count < 32) 
+        while (running && !session->closing) {
+            bool want_write;
             {
-                strncpy_s(user_list.users[user_list.user_count], client.second.c_str(), sizeof(user_list.users[user_list.user_count]) - 1);
-                user_list.users[user_list.user_count][sizeof(user_list.users[user_list.user_count]) - 1] = '\0';
-                user_list.user_count++;
+                std::lock_guard<std::mutex> lock(session->send_mutex);
+                want_write = !session->outbound.empty();
             }
-        }
 
-        // broadcast to all user
-        MessageHeader header(MessageType::USER_LIST_UPDATE, sizeof(UserListMessage));
+            // senders queue without waking us, the timeout bounds how long
+            // queued output waits for the next writability check
+            bool readable, writable;
+            if (!wait_socket(session->socket, want_write, 100, readable, writable))
+                break;
+
+            if (writable && !session->flush())
+                break;
 
-        for (const auto& client : clients) 
-        {
-            send(client.first, (char*)&header, sizeof(header), 0);
-            send(client.first, (char*)&user_list, sizeof(user_list), 0);
+            if (readable) {
+                bool alive = session->read_available();
+                on_session_data(session);
+                if (!alive) {
+                    if (!session->username.empty())
+                        std::cout << "Client '" << session->username << "' disconnected" << std::endl;
+                    break;
+                }
+            }
         }
+
+        on_session_close(session);
+
+        // other threads may still hold the session from a client snapshot,
+        // once the descriptor is closed (and maybe reused) they must not touch it
+        std::lock_guard<std::mutex> lock(session->send_mutex);
+        session->closing = true;
+        closesocket(session->socket);
+        session->socket = INVALID_SOCKET;
     }
 
-    void handle_client(SOCKET client_socket) {
-        std::string username;
-        MessageHeader header;
+    // both backends: parse whatever frames arrived and act on them
+    void on_session_data(const std::shared_ptr<Session>& session) override {
+        bool intact = session->parse_frames([&](MessageType type, const char* body, int size) {
+            handle_message(session, type, body, size);
+        });
+        if (!intact) {
+            std::cout << "Bad frame from " << session->username << std::endl;
+            drop_session(session);
+        }
+    }
 
-        if (receive_message(client_socket, (char*)&header, sizeof(header)) != sizeof(header)) 
-        {
-            std::cout << "Failed to receive header" << std::endl;
-            close_client(client_socket, username);
+    void handle_message(const std::shared_ptr<Session>& session, MessageType type, const char* body, int size) {
+        // a batch is handled frame by frame, batches don't nest
+        if (type == MessageType::BATCH) {
+            bool intact = for_each_frame(body, size, [&](MessageType inner, const char* data, size_t length) {
+                if (inner != MessageType::BATCH && inner != MessageType::COMPRESSED && !session->closing)
+                    handle_message(session, inner, data, (int)length);
+            });
+            if (!intact)
+                drop_session(session);
             return;
         }
 
-        if (header.type != MessageType::CLIENT_CONNECT) 
-        {
-            close_client(client_socket, username);
+        // so are compressed frames, from a client that negotiated them; once
+        // one fails to inflate the stream is out of step for good
+        if (type == MessageType::COMPRESSED) {
+            std::vector<char>& raw = session->inflated;
+            bool intact = session->inflater && inflate_frames(*session->inflater, body, size, raw)
+                && for_each_frame(raw.data(), raw.size(), [&](MessageType inner, const char* data, size_t length) {
+                    if (inner != MessageType::COMPRESSED && !session->closing)
+                        handle_message(session, inner, data, (int)length);
+                });
+            if (!intact) {
+                std::cout << "Bad compressed frame from " << session->username << std::endl;
+                drop_session(session);
+            }
             return;
         }
 
-        ClientConnectMessage connect_message;
-        if (receive_message(client_socket, (char*)&connect_message, sizeof(connect_message)) != sizeof(connect_message)) 
-        {
-            std::cout << "Failed to receive connect message" << std::endl;
-            close_client(client_socket, username);
+        // the first message must introduce the user
+        if (!session->joined) {
+            if (type != MessageType::CLIENT_CONNECT) {
+                drop_session(session);
+                return;
+            }
+
+            ClientConnectView connect_message;
+            if (!decode_message(body, size, connect_message)) {
+                if (connect_message.version < MIN_PROTOCOL_VERSION) {
+                    PublicMessage message(SYSTEM_USER_ID, "Unsupported protocol version, please update the client");
+                    send_to(session, message);
+                }
+                drop_session(session);
+                return;
+            }
+            join(session, connect_message);
             return;
         }
 
-        username = connect_message.username;
-        // create client
+        if (type == MessageType::PUBLIC_MESSAGE)
         {
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            clients[client_socket] = username;
+            // relaying reads the message in place and copies the body once
+            PublicMessageView message;
+            if (!decode_message(body, size, message) || message.sender != session->user_id)
+                return;
+
+            std::cout << "Public message from " << session->username << ": " << message.content << std::endl;
+
+            // forward the received bytes as they are, one copy for the whole room
+            SharedBody relayed = make_body(body, size);
+            uint32_t sender = message.sender;
+            relay(session, [this, relayed, sender]() {
+                broadcast(MessageType::PUBLIC_MESSAGE, relayed, sender);
+            });
         }
+        else if (type == MessageType::PRIVATE_MESSAGE) {
 
-        std::cout << "User " << username << " joined the room" << std::endl;
+            PrivateMessageView message;
+            if (!decode_message(body, size, message) || message.sender != session->user_id)
+                return;
 
-        // send to new user
-        //
-        send_userlist(client_socket);
-        // send a public message to all user
-        PublicMessage message("System", username + " joined the chat");
-        MessageHeader send_header(MessageType::PUBLIC_MESSAGE, sizeof(PublicMessage));
+            // search target
+            std::shared_ptr<Session> target = client_snapshot()->find(message.target);
 
-        {
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            for (const auto& client : clients) {
-                // not send to myself
-                if (client.second != username) {
-                    send(client.first, (char*)&send_header, sizeof(send_header), 0);
-                    send(client.first, (char*)&message, sizeof(message), 0);
-                }
+            if (target) {
+                std::cout << "Private message from " << session->username << " to " << target->username << std::endl;
+
+                SharedBody relayed = make_body(body, size);
+                uint32_t sender = message.sender;
+                relay(session, [this, target, relayed, sender]() {
+                    send_to(target, MessageType::PRIVATE_MESSAGE, relayed, sender);
+                });
             }
         }
-        broadcast_userlist();
-
-        while (running) {
-
-            if (receive_message(client_socket, (char*)&header, sizeof(header)) != sizeof(header)) 
-            {
-                std::cout << "Client '" << username << "' disconnected" << std::endl;
-                break;
+        else if (type == MessageType::PUBLIC_FRAGMENT) {
+            // forwarded piece by piece as it comes, nothing is held here
+            PublicFragmentView fragment;
+            if (!decode_message(body, size, fragment) || fragment.sender != session->user_id)
+                return;
+
+            if (fragment.offset == 0)
+                std::cout << "Long public message from " << session->username << ", " << fragment.total << " bytes" << std::endl;
+
+            // clients without fragments get the first piece as it is
+            SharedBody piece = make_body(body, size);
+            SharedBody first = fragment.offset == 0 ? encode_body(PublicMessage(fragment.sender, fragment.chunk.str())) : nullptr;
+            uint32_t sender = fragment.sender;
+            relay(session, [this, piece, first, sender]() {
+                for_each_member([this, piece, first, sender](const std::shared_ptr<Session>& member) {
+                    if (member->has(CAP_FRAGMENTS))
+                        send_to(member, MessageType::PUBLIC_FRAGMENT, piece, sender);
+                    else if (first)
+                        send_to(member, MessageType::PUBLIC_MESSAGE, first, sender);
+                });
+            });
+        }
+        else if (type == MessageType::PRIVATE_FRAGMENT) {
+            PrivateFragmentView fragment;
+            if (!decode_message(body, size, fragment) || fragment.sender != session->user_id)
+                return;
+
+            std::shared_ptr<Session> target = client_snapshot()->find(fragment.target);
+            if (!target)
+                return;
+
+            if (fragment.offset == 0)
+                std::cout << "Long private message from " << session->username << " to " << target->username << ", " << fragment.total << " bytes" << std::endl;
+
+            // every piece goes through relay, a later one mustn't pass the first
+            SharedBody relayed;
+            MessageType type = MessageType::PRIVATE_FRAGMENT;
+            if (target->has(CAP_FRAGMENTS))
+                relayed = make_body(body, size);
+            else if (fragment.offset == 0) {
+                relayed = encode_body(PrivateMessage(fragment.sender, fragment.target, fragment.chunk.str()));
+                type = MessageType::PRIVATE_MESSAGE;
             }
+            else
+                return;
+            uint32_t sender = fragment.sender;
+            relay(session, [this, target, type, relayed, sender]() {
+                send_to(target, type, relayed, sender);
+            });
+        }
+        else if (type == MessageType::USER_LIST_REQUEST) {
+            // the next page, or a new list after the client missed a
+            // presence change
+            UserListRequest request;
+            if (!decode_message(body, size, request))
+                return;
+            send_userlist(session, request.version, request.offset);
+        }
+        else if (type == MessageType::CLIENT_DISCONNECT) {
+            std::cout << "Client " << session->username << " requested disconnect" << std::endl;
+            drop_session(session);
+        }
+        else {
+            std::cout << " unknown " << session->username << std::endl;
+        }
+    }
 
-            if (header.type == MessageType::PUBLIC_MESSAGE) 
-            {
+    void join(const std::shared_ptr<Session>& session, const ClientConnectView& connect_message) {
+        session->username = connect_message.username.str();
+        const std::string& username = session->username;
+        session->user_id = next_user_id++;
+        session->limits = &backpressure;
+        // the older side's version and the features both have, settled
+        // before anyone else can see the session
+        session->negotiate(connect_message.version < PROTOCOL_VERSION ? connect_message.version : PROTOCOL_VERSION,
+            connect_message.capabilities & SERVER_CAPABILITIES);
+
+        // create client, names are unique
+        uint32_t version = 0;
+        bool added = update_clients([&](ClientTable& all) {
+            if (!all.add(session))
+                return false;
+            version = all.version;
+            presence_log.push_back(PresenceChange{ version, true, session->user_id, username });
+            return true;
+        });
+        if (!added) {
+            std::cout << "User " << username << " rejected, name in use" << std::endl;
+            PublicMessage message(SYSTEM_USER_ID, "The name " + username + " is already in use");
+            send_to(session, message);
+            drop_session(session);
+            return;
+        }
+        session->join_version = version;
+        session->joined = true;
+        // we are on the session's own reactor thread here
+        if (session->owner != nullptr)
+            session->owner->members[session.get()] = session;
 
-                PublicMessage message;
+        std::cout << "User " << username << " joined the room" << std::endl;
 
-                if (receive_message(client_socket, (char*)&message, sizeof(message)) != sizeof(message)) {
-                    std::cout << "Failed to receive public message from " << username << std::endl;
-                    break;
-                }
+        // the new user gets its id and the first page of the list now and
+        // asks for the rest, everyone else gets the change with the next
+        // presence window, clients print the "joined the chat" line themselves
+        ClientAcceptedMessage accepted(session->user_id, session->version, session->capabilities);
+        send_to(session, accepted);
+        send_userlist(session);
+    }
 
-                std::cout << "Public message from " << message.sender << ": " << message.content << std::endl;
+    // send a frame to every joined user except `except`
+    // reactor mode: every reactor delivers to its own members on its own
+    // thread, no lock is held while sending
+    void broadcast(MessageType type, const void* data, int size, uint32_t sender = SYSTEM_USER_ID, const std::shared_ptr<Session>& except = nullptr) {
+        broadcast(type, make_body(data, size), sender, except);
+    }
 
-                MessageHeader header(MessageType::PUBLIC_MESSAGE, sizeof(PublicMessage));
+    // the body is built once, every recipient's queue references it
+    void broadcast(MessageType type, const SharedBody& body, uint32_t sender = SYSTEM_USER_ID, const std::shared_ptr<Session>& except = nullptr) {
+        for_each_member([this, type, body, sender, except](const std::shared_ptr<Session>& member) {
+            if (member != except)
+                send_to(member, type, body, sender);
+        });
+    }
 
-                for (const auto& client : clients) {
-                    send(client.first, (char*)&header, sizeof(header), 0);
-                    send(client.first, (char*)&message, sizeof(message), 0);
-                }
+    // deliver(session) for every joined user, in reactor mode on the
+    // reactor that owns the session
+    template <typename F>
+    void for_each_member(const F& deliver) {
+        if (reactors.empty()) {
+            // a slow peer blocks this thread only, not joins and leaves
+            std::shared_ptr<const ClientTable> table = client_snapshot();
+            for (const auto& client : table->by_socket) {
+                deliver(client.second);
             }
-            else if (header.type == MessageType::PRIVATE_MESSAGE) {
-
-                PrivateMessage message;
+            return;
+        }
 
-                if (receive_message(client_socket, (char*)&message, sizeof(message)) != sizeof(message)) {
-                    std::cout << "Failed to receive private message from " << username << std::endl;
-                    break;
+        for (auto& reactor : reactors) {
+            Reactor* shard = reactor.get();
+            shard->run_in_loop([shard, deliver]() {
+                for (const auto& member : shard->members) {
+                    deliver(member.second);
                 }
+            });
+        }
+    }
 
-                std::cout << "Private message from " << message.sender << " to " << message.target << std::endl;
+    // send a frame, a failed socket gets dropped by its backend
+    // sessions of another reactor are handed to that reactor's mailbox
+    // sender is the user whose message it is, a sender's frames stay in order
+    void send_to(const std::shared_ptr<Session>& session, MessageType type, const void* data, int size, uint32_t sender = SYSTEM_USER_ID) {
+        send_to(session, type, make_body(data, size), sender);
+    }
 
-                std::lock_guard<std::mutex> lock(clients_mutex);
+    // any message with a schema, sent as the type its schema names
+    template <typename M>
+    void send_to(const std::shared_ptr<Session>& session, const M& message, uint32_t sender = SYSTEM_USER_ID) {
+        send_to(session, message_type(message), encode_body(message), sender);
+    }
 
-                // search target
-                SOCKET targetSocket = INVALID_SOCKET;
-                for (const auto& client : clients) {
-                    if (client.second == message.target) {
-                        targetSocket = client.first;
-                        break;
-                    }
-                }
+    void send_to(const std::shared_ptr<Session>& session, MessageType type, const SharedBody& body, uint32_t sender = SYSTEM_USER_ID) {
+        Reactor* shard = session->owner;
+        if (shard != nullptr && !shard->in_loop()) {
+            shard->post([this, session, type, body, sender]() {
+                send_to(session, type, body, sender);
+            });
+            return;
+        }
 
-                if (targetSocket != INVALID_SOCKET) {
-                    MessageHeader header(MessageType::PRIVATE_MESSAGE, sizeof(PrivateMessage));
-                    send(targetSocket, (char*)&header, sizeof(header), 0);
-                    send(targetSocket, (char*)&message, sizeof(message), 0);
-                }
-            }
-            else if (header.type == MessageType::CLIENT_DISCONNECT) {
-                std::cout << "Client " << username << " requested disconnect" << std::endl;
-                break;
-            }
-            else {
-                std::cout << " unknown " << username << std::endl;
-            }
+        if (!session->send_frame(type, body, sender))
+            drop_session(session);
+    }
+
+    // end a session from any thread, the owning backend does the cleanup
+    void drop_session(const std::shared_ptr<Session>& session) {
+        Reactor* shard = session->owner;
+        if (shard != nullptr) {
+            shard->run_in_loop([shard, session]() {
+                shard->defer_close(session);
+            });
+            return;
         }
+        // wakes the wait in handle_client
+        std::lock_guard<std::mutex> lock(session->send_mutex);
+        session->closing = true;
+        if (session->socket != INVALID_SOCKET)
+            shutdown(session->socket, SHUT_RDWR);
+    }
 
-        close_client(client_socket, username);
+    // both backends: the connection is finished
+    void on_session_close(const std::shared_ptr<Session>& session) override {
+        close_client(session);
     }
 
+    void close_client(const std::shared_ptr<Session>& session) {
+        if (session->joined) {
+            session->joined = false;
+
+            update_clients([&](ClientTable& all) {
+                all.remove(session);
+                presence_log.push_back(PresenceChange{ all.version, false, session->user_id, session->username });
+                return true;
+            });
+            if (session->owner != nullptr)
+                session->owner->members.erase(session.get());
 
-    void close_client(SOCKET clientSocket, const std::string& username) {
-        if (!username.empty()) {
+            std::cout << "User '" << session->username << "' left the chat" << std::endl;
 
+        }
+    }
+
+    // every presence window: send the joins and leaves it collected
+    void presence_loop() {
+        std::unique_lock<std::mutex> lock(presence_mutex);
+        while (running) {
+            presence_wake.wait_for(lock, std::chrono::milliseconds(presence_window_ms));
+            if (!running)
+                break;
+            lock.unlock();
             {
-                std::lock_guard<std::mutex> lock(clients_mutex);
-                clients.erase(clientSocket);
+                std::lock_guard<std::mutex> flushing(presence_flush_mutex);
+                flush_presence();
             }
+            lock.lock();
+        }
+    }
 
-            std::cout << "User '" << username << "' left the chat" << std::endl;
+    // with presence_flush_mutex held
+    void flush_presence() {
+        std::shared_ptr<PresenceBatch> batch = std::make_shared<PresenceBatch>();
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            if (presence_log.empty())
+                return;
+            batch->changes.swap(presence_log);
+            batch->end = client_snapshot()->version;
+        }
+        batch->start = presence_sent;
+        batch->frames = build_presence_frames(batch->changes, batch->start, batch->end);
+
+        std::shared_ptr<const PresenceBatch> shared = batch;
+        if (reactors.empty()) {
+            std::shared_ptr<const ClientTable> table = client_snapshot();
+            for (const auto& client : table->by_socket) {
+                send_presence(client.second, *shared);
+            }
+            presence_sent = batch->end;
+            return;
+        }
 
-            MessageHeader header(MessageType::PUBLIC_MESSAGE, sizeof(PublicMessage));
-            PublicMessage message("System", username + " left the chat");
+        for (auto& reactor : reactors) {
+            Reactor* shard = reactor.get();
+            // inline on our own reactor, like a broadcast that follows it
+            shard->run_in_loop([this, shard, shared]() {
+                for (const auto& member : shard->members) {
+                    send_presence(member.second, *shared);
+                }
+                shard->presence_version = shared->end;
+            });
+        }
+        presence_sent = batch->end;
+    }
 
-            for (const auto& client : clients) 
-            {
-                send(client.first, (char*)&header, sizeof(header), 0);
-                send(client.first, (char*)&message, sizeof(message), 0);
-            }
-            broadcast_userlist();
+    // deliver() relays a message of the session's user; the others must
+    // know the user's name before they get it. once the user's join is out
+    // that is two loads, before that the window with the join is sent now
+    // if nobody took it yet; mailboxes and the blocking sends keep the order
+    //
+    // a window the presence thread posted may still wait in this reactor's
+    // mailbox while deliver() would reach this reactor's members inline, the
+    // message then queues behind the window in the mailbox. so do the
+    // user's later messages until the window ran, they stay in order
+    template <typename F>
+    void relay(const std::shared_ptr<Session>& session, const F& deliver) {
+        uint32_t joined = session->join_version;
+        if (presence_sent < joined) {
+            std::lock_guard<std::mutex> flushing(presence_flush_mutex);
+            if (presence_sent < joined)
+                flush_presence();
         }
 
-        closesocket(clientSocket);
+        Reactor* shard = session->owner;
+        if (shard != nullptr && shard->presence_version < joined) {
+            shard->post(deliver);
+            return;
+        }
+        deliver();
     }
 
-    int receive_message(SOCKET socket, char* buffer, int size) {
-        int totalReceived = 0;
-        while (totalReceived < size) {
-            int received = recv(socket, buffer + totalReceived, size - totalReceived, 0);
-            if (received <= 0) {
-                return received;
-            }
-            totalReceived += received;
+    // bring one client up to the end of the window, clients that already
+    // are or whose list wouldn't change are skipped
+    void send_presence(const std::shared_ptr<Session>& session, const PresenceBatch& batch) {
+        uint32_t seen = session->presence_version;
+        // no full list yet, it will include the window
+        if (seen == 0 || seen >= batch.end)
+            return;
+
+        // a client that doesn't take deltas starts over with the list
+        if (!session->has(CAP_PRESENCE_DELTA)) {
+            send_userlist(session);
+            return;
+        }
+
+        std::vector<PresenceFrame> own;
+        if (seen != batch.start)
+            own = build_presence_frames(batch.changes, seen, batch.end);
+        const std::vector<PresenceFrame>& frames = seen == batch.start ? batch.frames : own;
+        if (frames.empty())
+            return;
+
+        session->presence_version = batch.end;
+        for (const PresenceFrame& frame : frames) {
+            send_to(session, frame.type, frame.body);
         }
-        return totalReceived;
     }
 
-    void send_userlist(SOCKET target) {
-        std::lock_guard<std::mutex> lock(clients_mutex);
+    void print_stats() {
+        std::cout << "Slow consumers: " << backpressure.publics_dropped << " public messages dropped, "
+            << backpressure.fragments_dropped << " message pieces dropped, "
+            << backpressure.userlists_coalesced << " user lists coalesced, "
+            << backpressure.disconnects << " disconnected" << std::endl;
+    }
 
-        UserListMessage list;
-        list.user_count = 0;
+    // one page of the user list, version 0 or a list the client no longer
+    // has starts a new one at the current version; the users are taken once
+    // per list so every page comes from the same snapshot
+    void send_userlist(const std::shared_ptr<Session>& target, uint32_t version = 0, uint32_t offset = 0) {
+        std::lock_guard<std::mutex> lock(target->listing_mutex);
+        if (version == 0 || !target->listing || version != target->listing_version) {
+            std::shared_ptr<const ClientTable> table = client_snapshot();
+            auto users = std::make_shared<std::vector<UserEntry>>();
+            users->reserve(table->by_id.size());
+            for (const auto& client : table->by_id) {
+                users->push_back(UserEntry{ client.first, client.second->username });
+            }
 
-        // collect all username
-        for (const auto& client : clients) 
-        {
-            strncpy_s(list.users[list.user_count], client.second.c_str(), sizeof(list.users[list.user_count]) - 1);
-            list.users[list.user_count][sizeof(list.users[list.user_count]) - 1] = '\0';
-            list.user_count++;
+            target->listing = users;
+            target->listing_version = table->version;
+            // presence changes from here on build on this list
+            target->presence_version = table->version;
+            offset = 0;
         }
 
-        MessageHeader header(MessageType::USER_LIST_UPDATE, sizeof(UserListMessage));
+        const std::vector<UserEntry>& users = *target->listing;
+        UserListMessage page;
+        page.version = target->listing_version;
+        page.total = (uint32_t)users.size();
+        page.offset = offset < page.total ? offset : page.total;
+        uint32_t end = page.total - page.offset > USER_LIST_PAGE ? page.offset + USER_LIST_PAGE : page.total;
+        page.users.assign(users.begin() + page.offset, users.begin() + end);
+
+        // the last page is out, the snapshot isn't needed any more
+        if (end == page.total)
+            target->listing.reset();
 
-        send(target, (char*)&header, sizeof(header), 0);
-        send(target, (char*)&list, sizeof(list), 0);
+        send_to(target, page);
     }
 
 };
 
-int main() {
+// a positive decimal number and nothing else
+static bool parse_count(const char* text, int& value) {
+    char* end = nullptr;
+    long parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || parsed <= 0 || parsed > 0x7fffffff)
+        return false;
+    value = (int)parsed;
+    return true;
+}
+
+static int usage() {
+    std::cout << "usage: chat_room_server [blocking|epoll|io_uring] [reactor threads] [drop|disconnect] [presence window ms]"
+        << " [high watermark KB] [low watermark KB]" << std::endl;
+    return 1;
+}
+
+int main(int argc, char** argv) {
+#ifdef __linux__
+    ServerBackend backend = ServerBackend::EPOLL;
+#else
+    ServerBackend backend = ServerBackend::BLOCKING;
+#endif
+
+    // one reactor per core by default
+    int threads = (int)std::thread::hardware_concurrency();
+    if (threads <= 0)
+        threads = 1;
+
+    // chat_room_server [blocking|epoll|io_uring] [reactor threads] [drop|disconnect] [presence window ms]
+    //                  [high watermark KB] [low watermark KB]
+    // an argument that isn't one of these stops here, a typo doesn't
+    // quietly run something else
+    if (argc > 7)
+        return usage();
+    if (argc > 1) {
+        std::string mode = argv[1];
+        if (mode == "blocking")
+            backend = ServerBackend::BLOCKING;
+        else if (mode == "epoll")
+            backend = ServerBackend::EPOLL;
+        else if (mode == "io_uring")
+            backend = ServerBackend::IO_URING;
+        else
+            return usage();
+    }
+    if (argc > 2 && !parse_count(argv[2], threads))
+        return usage();
+
+    ChatServer server;
+    if (argc > 3) {
+        std::string policy = argv[3];
+        if (policy == "disconnect")
+            server.backpressure.policy = SlowConsumerPolicy::DISCONNECT;
+        else if (policy != "drop")
+            return usage();
+    }
+    if (argc > 4 && !parse_count(argv[4], server.presence_window_ms))
+        return usage();
+    int kb = 0;
+    if (argc > 5) {
+        if (!parse_count(argv[5], kb))
+            return usage();
+        server.backpressure.high_watermark = (size_t)kb * 1024;
+    }
+    if (argc > 6) {
+        if (!parse_count(argv[6], kb))
+            return usage();
+        server.backpressure.low_watermark = (size_t)kb * 1024;
+    }
+    if (server.backpressure.low_watermark >= server.backpressure.high_watermark) {
+        std::cout << "The low watermark has to be below the high watermark" << std::endl;
+        return 1;
+    }
+
     std::cout << "Chat Server" << std::endl;
     std::cout << "Starting server on port 65432" << std::endl;
 
-    ChatServer server;
-    if (!server.init(65432)) {
+    if (!server.init(65432, backend, threads)) {
         std::cout << "Start server failed" << std::endl;
         return 1;
     }
 
-    std::cin.get();
+    // "stats" prints the slow consumer counters, anything else stops the server
+    std::string command;
+    while (std::getline(std::cin, command) && command == "stats") {
+        server.print_stats();
+    }
 
     server.close();
     return 0;
-}
\ No newline at end of file
+}
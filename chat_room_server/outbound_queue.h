@@ -0,0 +1,358 @@
+﻿#pragma once
+// frames waiting to go out on one socket
+// header and body stay separate buffers, a flush gathers every pending frame
+// into one sendmsg / WSASend instead of a send() per piece
+// frames that queue up between flushes go out packed in batch frames: the
+// batch header is one more slice in front of them, nothing is copied
+// with compression they go out in COMPRESSED frames instead
+// chat queued behind the pieces of someone else's long message goes out
+// ahead of them
+#include "platform.h"
+#include "net_protocol.h"
+#include "lz_codec.h"
+#include <deque>
+#include <vector>
+#include <memory>
+
+// an encoded message body, never changed once built
+// a broadcast builds it once and every recipient's queue holds a reference
+typedef std::shared_ptr<const std::vector<char>> SharedBody;
+
+// a flush commits at most this many queued bytes before it looks at the
+// queue again, what queues behind them can still be reordered or dropped
+const size_t FLUSH_AHEAD = 64 * 1024;
+
+inline SharedBody make_body(const void* data, int size)
+{
+    return std::make_shared<const std::vector<char>>((const char*)data, (const char*)data + size);
+}
+
+template <typename M>
+SharedBody encode_body(const M& message)
+{
+    return std::make_shared<const std::vector<char>>(encode_message(message));
+}
+
+// pieces of long messages, they may queue up in large numbers
+inline bool is_fragment(MessageType type)
+{
+    return type == MessageType::PUBLIC_FRAGMENT || type == MessageType::PRIVATE_FRAGMENT;
+}
+
+struct OutboundFrame {
+    MessageType type;
+    // the user whose message this is, SYSTEM_USER_ID for the server's own
+    uint32_t sender;
+    // encoded header
+    char header[MAX_FRAME_HEADER];
+    uint8_t header_size;
+    SharedBody body;
+    // set on the first frame of a batch: the batch header and how many
+    // frames the batch holds
+    char batch_header[MAX_FRAME_HEADER];
+    uint8_t batch_header_size;
+    uint16_t batch_count;
+
+    OutboundFrame() : type(MessageType::CLIENT_CONNECT), sender(SYSTEM_USER_ID), header(), header_size(0), batch_header(), batch_header_size(0), batch_count(0) {}
+
+    size_t size() const { return batch_header_size + header_size + body->size(); }
+};
+
+// forget the batches of frames from first on, returns the header bytes removed
+inline size_t unbatch_frames(std::deque<OutboundFrame>& frames, size_t first)
+{
+    size_t removed = 0;
+    for (size_t i = first; i < frames.size(); i++) {
+        removed += frames[i].batch_header_size;
+        frames[i].batch_header_size = 0;
+        frames[i].batch_count = 0;
+    }
+    return removed;
+}
+
+// pack runs of frames from first on into batches of up to MAX_BATCH_BODY
+// bytes, a frame that fits nowhere goes alone; returns the header bytes added
+inline size_t batch_frames(std::deque<OutboundFrame>& frames, size_t first)
+{
+    size_t added = 0;
+    size_t start = first;
+    while (start < frames.size()) {
+        size_t body = 0;
+        size_t end = start;
+        while (end < frames.size() && end - start < 0xffff && body + frames[end].size() <= MAX_BATCH_BODY) {
+            body += frames[end].size();
+            end++;
+        }
+
+        if (end - start >= 2) {
+            OutboundFrame& opener = frames[start];
+            opener.batch_header_size = (uint8_t)MessageHeader(MessageType::BATCH, (unsigned int)body).encode(opener.batch_header);
+            opener.batch_count = (uint16_t)(end - start);
+            added += opener.batch_header_size;
+        }
+        start = end > start ? end : start + 1;
+    }
+    return added;
+}
+
+// replace runs of frames of up to MAX_BATCH_BODY bytes with COMPRESSED
+// frames; a run too short to be worth it and a frame that fits nowhere go
+// out as they are
+inline void compress_frames(std::deque<OutboundFrame>& frames, LzEncoder& encoder)
+{
+    std::deque<OutboundFrame> packed;
+    std::vector<char> raw;
+    size_t start = 0;
+    while (start < frames.size()) {
+        raw.clear();
+        size_t end = start;
+        while (end < frames.size() && raw.size() + frames[end].size() <= MAX_BATCH_BODY) {
+            const OutboundFrame& frame = frames[end];
+            raw.insert(raw.end(), frame.header, frame.header + frame.header_size);
+            raw.insert(raw.end(), frame.body->begin(), frame.body->end());
+            end++;
+        }
+
+        if (raw.size() < LZ_MIN_INPUT) {
+            if (end == start)
+                end++;
+            for (; start < end; start++) {
+                packed.push_back(std::move(frames[start]));
+            }
+            continue;
+        }
+
+        WireWriter out;
+        out.varint(raw.size());
+        encoder.compress(raw.data(), raw.size(), out);
+
+        packed.emplace_back();
+        OutboundFrame& frame = packed.back();
+        frame.type = MessageType::COMPRESSED;
+        frame.header_size = (uint8_t)MessageHeader(frame.type, (unsigned int)out.bytes.size()).encode(frame.header);
+        frame.body = std::make_shared<const std::vector<char>>(std::move(out.bytes));
+        start = end;
+    }
+    frames.swap(packed);
+}
+
+class OutboundQueue {
+public:
+    std::deque<OutboundFrame> frames;
+    // bytes of the first frame already written
+    size_t front_sent;
+    // bytes queued and not written yet
+    size_t pending;
+    // frames at the front that have to go out as they are: the rest of a
+    // batch or a frame that is partly written
+    size_t sealed;
+    // the peer takes batch frames
+    bool batching;
+    // set once the peer takes COMPRESSED frames; only compressed frames are
+    // written then, FLUSH_AHEAD bytes of frames at a time, the rest is
+    // compressed once they are out, so a backlog stays uncompressed and the
+    // backpressure policy can still drop from it
+    std::unique_ptr<LzEncoder> encoder;
+
+    OutboundQueue() : front_sent(0), pending(0), sealed(0), batching(false) {}
+
+    bool empty() const { return frames.empty(); }
+
+    // chat goes in ahead of the unsent pieces of other users' long
+    // messages queued last, a long paste doesn't hold up everyone else's
+    // lines; a sender's own messages keep their order
+    void push(MessageType type, const SharedBody& body, uint32_t sender = SYSTEM_USER_ID) {
+        size_t at = frames.size();
+        if (type == MessageType::PUBLIC_MESSAGE || type == MessageType::PRIVATE_MESSAGE) {
+            while (at > first_unsent() && is_fragment(frames[at - 1].type) && frames[at - 1].sender != sender)
+                at--;
+        }
+        // batches are rebuilt on the next write
+        if (at < frames.size())
+            pending -= unbatch_frames(frames, first_unsent());
+
+        OutboundFrame& frame = *frames.emplace(frames.begin() + at);
+        frame.type = type;
+        frame.sender = sender;
+        frame.header_size = (uint8_t)MessageHeader(type, (unsigned int)body->size()).encode(frame.header);
+        frame.body = body;
+        pending += frame.size();
+    }
+
+    // the unsent bytes of the first limit frames as at most max slices,
+    // oldest first
+    int gather(IoSlice* slices, int max, size_t limit) const {
+        int count = 0;
+        size_t skip = front_sent;
+
+        for (auto it = frames.begin(); it != frames.end() && it - frames.begin() < (ptrdiff_t)limit && count < max; ++it) {
+            if (skip < it->batch_header_size) {
+                slices[count].data = it->batch_header + skip;
+                slices[count].size = it->batch_header_size - skip;
+                count++;
+                skip = 0;
+            }
+            else {
+                skip -= it->batch_header_size;
+            }
+
+            if (count < max && skip < it->header_size) {
+                slices[count].data = it->header + skip;
+                slices[count].size = it->header_size - skip;
+                count++;
+                skip = 0;
+            }
+            else {
+                skip -= it->header_size;
+            }
+
+            if (count < max && skip < it->body->size()) {
+                slices[count].data = it->body->data() + skip;
+                slices[count].size = it->body->size() - skip;
+                count++;
+            }
+            skip = 0;
+        }
+        return count;
+    }
+
+    // regroup the frames nothing has been written of into batches
+    void batch() {
+        if (!batching || encoder)
+            return;
+        pending -= unbatch_frames(frames, sealed);
+        pending += batch_frames(frames, sealed);
+    }
+
+    // compress the frames at the front, up to FLUSH_AHEAD bytes of them;
+    // nothing may be written of them yet
+    void compress() {
+        std::deque<OutboundFrame> ahead = take(FLUSH_AHEAD);
+        compress_frames(ahead, *encoder);
+        sealed = ahead.size();
+        while (!ahead.empty()) {
+            pending += ahead.back().size();
+            frames.push_front(std::move(ahead.back()));
+            ahead.pop_back();
+        }
+    }
+
+    // move frames off the front, up to max bytes of them but at least one;
+    // nothing may be written of them yet
+    std::deque<OutboundFrame> take(size_t max) {
+        std::deque<OutboundFrame> taken;
+        size_t bytes = 0;
+        while (!frames.empty() && (taken.empty() || bytes + frames.front().size() <= max)) {
+            bytes += frames.front().size();
+            taken.push_back(std::move(frames.front()));
+            frames.pop_front();
+        }
+        pending -= bytes;
+        return taken;
+    }
+
+    // forget bytes the kernel accepted
+    void consume(size_t bytes) {
+        pending -= bytes;
+        bytes += front_sent;
+        while (!frames.empty() && bytes >= frames.front().size()) {
+            bytes -= frames.front().size();
+            // the rest of a batch that started going out has to follow
+            if (frames.front().batch_count > 1)
+                sealed = frames.front().batch_count - 1;
+            else if (sealed > 0)
+                sealed--;
+            frames.pop_front();
+        }
+        front_sent = bytes;
+        if (front_sent > 0 && sealed == 0)
+            sealed = frames.front().batch_count > 1 ? frames.front().batch_count : 1;
+    }
+
+    // drop every unsent frame of this type but the newest, returns how many
+    size_t drop_stale(MessageType type) {
+        size_t newest = frames.size();
+        for (size_t i = frames.size(); i > first_unsent(); i--) {
+            if (frames[i - 1].type == type) {
+                newest = i - 1;
+                break;
+            }
+        }
+        if (newest == frames.size())
+            return 0;
+
+        return remove_if([&](size_t i, const OutboundFrame& frame) {
+            return i != newest && frame.type == type;
+        }, 0);
+    }
+
+    // drop unsent frames of this type, oldest first, until no more than
+    // target bytes are pending, returns how many
+    size_t drop_oldest(MessageType type, size_t target) {
+        return remove_if([&](size_t, const OutboundFrame& frame) {
+            return frame.type == type;
+        }, target);
+    }
+
+    void clear() {
+        frames.clear();
+        front_sent = 0;
+        pending = 0;
+        sealed = 0;
+    }
+
+    // a partly written frame or batch has to go out whole
+    size_t first_unsent() const {
+        return sealed;
+    }
+
+    // remove unsent frames matching drop(index, frame) while more than
+    // target bytes are pending
+    template <typename F>
+    size_t remove_if(F&& drop, size_t target) {
+        // batches are rebuilt on the next write
+        pending -= unbatch_frames(frames, first_unsent());
+
+        std::deque<OutboundFrame> kept;
+        size_t removed = 0;
+
+        for (size_t i = 0; i < frames.size(); i++) {
+            if (i >= first_unsent() && pending > target && drop(i, frames[i])) {
+                pending -= frames[i].size();
+                removed++;
+                continue;
+            }
+            kept.push_back(std::move(frames[i]));
+        }
+        frames.swap(kept);
+        return removed;
+    }
+
+    // write until the queue is empty or the socket is full
+    // returns false if the socket failed
+    bool write_to(SOCKET s) {
+        IoSlice slices[MAX_SEND_SLICES];
+
+        // what queued up since the last write goes out in batches
+        batch();
+        while (!frames.empty()) {
+            if (encoder && sealed == 0)
+                compress();
+            int count = gather(slices, MAX_SEND_SLICES, encoder ? sealed : frames.size());
+            int sent = send_slices(s, slices, count);
+            if (sent > 0) {
+                consume(sent);
+                continue;
+            }
+
+            int error = socket_error();
+            if (sent < 0 && socket_interrupted(error))
+                continue;
+            // kernel buffer full, the rest goes out on the next writable event
+            if (sent < 0 && socket_would_block(error))
+                return true;
+            return false;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,190 @@
+﻿#pragma once
+// socket helpers so the server builds with WinSock on Windows
+// and with BSD sockets on Linux
+#include <cstddef>
+#include <cstring>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+typedef int socklen_t;
+
+#define SHUT_RDWR SD_BOTH
+
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+
+typedef int SOCKET;
+
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+
+inline int closesocket(SOCKET s) { return ::close(s); }
+
+// msvc secure crt functions used by net_protocol.h
+#define _TRUNCATE ((size_t)-1)
+
+inline int strncpy_s(char* dest, size_t dest_size, const char* src, size_t count)
+{
+    if (dest == nullptr || dest_size == 0)
+        return EINVAL;
+
+    size_t len = strlen(src);
+    if (count != _TRUNCATE && count < len)
+        len = count;
+    if (len >= dest_size)
+        len = dest_size - 1;
+
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+    return 0;
+}
+
+template <size_t N>
+inline int strncpy_s(char (&dest)[N], const char* src, size_t count)
+{
+    return strncpy_s(dest, N, src, count);
+}
+#endif
+
+inline bool socket_startup()
+{
+#ifdef _WIN32
+    WSADATA wsaData;
+    return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+#else
+    return true;
+#endif
+}
+
+inline void socket_cleanup()
+{
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+inline int socket_error()
+{
+#ifdef _WIN32
+    return WSAGetLastError();
+#else
+    return errno;
+#endif
+}
+
+// the call failed only because a non-blocking socket isn't ready
+inline bool socket_would_block(int error)
+{
+#ifdef _WIN32
+    return error == WSAEWOULDBLOCK;
+#else
+    return error == EAGAIN || error == EWOULDBLOCK;
+#endif
+}
+
+inline bool socket_interrupted(int error)
+{
+#ifdef _WIN32
+    return error == WSAEINTR;
+#else
+    return error == EINTR;
+#endif
+}
+
+inline bool set_nonblocking(SOCKET s)
+{
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(s, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    return flags != -1 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+// wait up to timeout_ms for the socket to become readable, or writable too
+// with want_write, hangups and errors count as readable so recv reports them
+// returns false if the wait itself failed
+inline bool wait_socket(SOCKET s, bool want_write, int timeout_ms, bool& readable, bool& writable)
+{
+    pollfd entry;
+    entry.fd = s;
+    entry.events = POLLIN | (want_write ? POLLOUT : 0);
+    entry.revents = 0;
+
+#ifdef _WIN32
+    int ready = WSAPoll(&entry, 1, timeout_ms);
+#else
+    int ready = poll(&entry, 1, timeout_ms);
+#endif
+    readable = false;
+    writable = false;
+    if (ready < 0)
+        return socket_interrupted(socket_error());
+
+    writable = (entry.revents & POLLOUT) != 0;
+    readable = (entry.revents & (POLLIN | POLLERR | POLLHUP)) != 0;
+    return true;
+}
+
+// send() flag so a dead peer returns an error instead of raising SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// one piece of a gathered write
+struct IoSlice {
+    const char* data;
+    size_t size;
+};
+
+// most slices handed to one send_slices call
+#define MAX_SEND_SLICES 64
+
+// write several buffers with one syscall (sendmsg / WSASend)
+// returns the bytes sent or SOCKET_ERROR
+inline int send_slices(SOCKET s, const IoSlice* slices, int count)
+{
+    if (count > MAX_SEND_SLICES)
+        count = MAX_SEND_SLICES;
+
+#ifdef _WIN32
+    WSABUF buffers[MAX_SEND_SLICES];
+    for (int i = 0; i < count; i++) {
+        buffers[i].buf = (CHAR*)slices[i].data;
+        buffers[i].len = (ULONG)slices[i].size;
+    }
+
+    DWORD sent = 0;
+    if (WSASend(s, buffers, (DWORD)count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+    return (int)sent;
+#else
+    iovec buffers[MAX_SEND_SLICES];
+    for (int i = 0; i < count; i++) {
+        buffers[i].iov_base = (void*)slices[i].data;
+        buffers[i].iov_len = slices[i].size;
+    }
+
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = buffers;
+    message.msg_iovlen = count;
+    return (int)sendmsg(s, &message, SEND_FLAGS);
+#endif
+}
@@ -0,0 +1,75 @@
+﻿#pragma once
+// presence coalescing
+// joins and leaves are logged as they happen and sent out once per window,
+// every client gets only the net change per user since the version it has,
+// someone who joins and leaves inside one window costs nothing
+#include "net_protocol.h"
+#include "outbound_queue.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+struct PresenceChange {
+    uint32_t version;
+    bool joined;
+    uint32_t user_id;
+    std::string username;
+};
+
+struct PresenceFrame {
+    MessageType type;
+    SharedBody body;
+};
+
+// one window of changes, shared by every reactor that delivers it
+struct PresenceBatch {
+    // versions before and after the window
+    uint32_t start;
+    uint32_t end;
+    std::vector<PresenceChange> changes;
+    // what a client at start gets, most clients are
+    std::vector<PresenceFrame> frames;
+};
+
+// the frames that bring a client from version seen to version end, each
+// one based on the version of the one before
+inline std::vector<PresenceFrame> build_presence_frames(const std::vector<PresenceChange>& changes, uint32_t seen, uint32_t end)
+{
+    // first and last change of every user the client hasn't seen
+    std::unordered_map<uint32_t, std::pair<size_t, size_t>> span;
+    for (size_t i = 0; i < changes.size(); i++) {
+        if (changes[i].version <= seen)
+            continue;
+        auto it = span.find(changes[i].user_id);
+        if (it == span.end())
+            span.emplace(changes[i].user_id, std::make_pair(i, i));
+        else
+            it->second.second = i;
+    }
+
+    // joined then left (or the other way round) ends where it started
+    std::vector<size_t> net;
+    for (const auto& entry : span) {
+        if (changes[entry.second.first].joined == changes[entry.second.second].joined)
+            net.push_back(entry.second.second);
+    }
+    std::sort(net.begin(), net.end());
+
+    std::vector<PresenceFrame> frames;
+    uint32_t base = seen;
+    for (size_t n = 0; n < net.size(); n++) {
+        const PresenceChange& change = changes[net[n]];
+        // the last frame takes the client all the way to the end of the window
+        uint32_t version = n + 1 == net.size() ? end : change.version;
+
+        // the others only need the id to drop someone
+        PresenceMessage message(base, version, change.user_id, change.joined ? change.username : std::string());
+        PresenceFrame frame;
+        frame.type = change.joined ? MessageType::USER_JOINED : MessageType::USER_LEFT;
+        frame.body = encode_body(message);
+        frames.push_back(frame);
+        base = version;
+    }
+    return frames;
+}
@@ -0,0 +1,105 @@
+﻿#pragma once
+// base of the event loop backends
+// a reactor is one thread that owns a shard of the sessions, other threads
+// never touch those sessions directly, they post work to its mailbox
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+struct Session;
+
+class Reactor {
+public:
+    // shard number, the loop thread is pinned to this core
+    int index;
+    std::atomic<bool> running;
+    std::thread loop_thread;
+    std::atomic<std::thread::id> loop_id;
+
+    // joined sessions of this shard, loop thread only
+    std::unordered_map<Session*, std::shared_ptr<Session>> members;
+    // presence version the members were last brought up to, loop thread only
+    uint32_t presence_version;
+
+    // work posted from other threads, run by the loop between batches
+    std::mutex mailbox_mutex;
+    std::vector<std::function<void()>> mailbox;
+
+    Reactor() : index(0), running(false), presence_version(0) {}
+    virtual ~Reactor() {}
+
+    // start the loop thread, once every reactor is set up
+    void launch() {
+        running = true;
+        loop_thread = std::thread([this]() { run(); });
+    }
+
+    // the loop, on its own thread
+    virtual void run() = 0;
+    // stop the loop thread and close its sessions
+    virtual void stop() = 0;
+    // close the session once the loop is done with the current batch
+    virtual void defer_close(const std::shared_ptr<Session>& session) = 0;
+    // the session queued output, write it out at the end of the batch
+    virtual void schedule_flush(const std::shared_ptr<Session>& session) = 0;
+    // interrupt the loop's wait, called from other threads
+    virtual void wake() = 0;
+
+    bool in_loop() const {
+        return std::this_thread::get_id() == loop_id.load();
+    }
+
+    // run on the loop thread, right away if we are already on it
+    void run_in_loop(std::function<void()> task) {
+        if (in_loop()) {
+            task();
+            return;
+        }
+        post(std::move(task));
+    }
+
+    void post(std::function<void()> task) {
+        bool was_empty;
+        {
+            std::lock_guard<std::mutex> lock(mailbox_mutex);
+            was_empty = mailbox.empty();
+            mailbox.push_back(std::move(task));
+        }
+        // the loop drains its own posts before it waits again
+        if (was_empty && !in_loop())
+            wake();
+    }
+
+    void run_mailbox() {
+        std::vector<std::function<void()>> tasks;
+        {
+            std::lock_guard<std::mutex> lock(mailbox_mutex);
+            tasks.swap(mailbox);
+        }
+        for (auto& task : tasks) {
+            task();
+        }
+    }
+
+    // first call on the loop thread
+    void enter_loop() {
+        loop_id = std::this_thread::get_id();
+#ifdef __linux__
+        unsigned cores = std::thread::hardware_concurrency();
+        if (cores > 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(index % cores, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+#endif
+    }
+};
@@ -0,0 +1,255 @@
+﻿#pragma once
+#include "platform.h"
+#include "net_protocol.h"
+#include "reactor.h"
+#include "outbound_queue.h"
+#include <string>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <atomic>
+
+// what to do with a client whose queue passes the high watermark
+enum class SlowConsumerPolicy {
+    DROP,        // coalesce user lists, drop the oldest public messages
+    DISCONNECT,  // close the connection
+};
+
+// send queue limits, shared by every session of a server
+struct Backpressure {
+    // a queue over high is cut back to low
+    size_t high_watermark;
+    size_t low_watermark;
+    SlowConsumerPolicy policy;
+
+    // what the policy did so far
+    std::atomic<uint64_t> publics_dropped;
+    std::atomic<uint64_t> fragments_dropped;
+    std::atomic<uint64_t> userlists_coalesced;
+    std::atomic<uint64_t> disconnects;
+
+    Backpressure()
+        : high_watermark(1024 * 1024), low_watermark(256 * 1024), policy(SlowConsumerPolicy::DROP),
+          publics_dropped(0), fragments_dropped(0), userlists_coalesced(0), disconnects(0)
+    {}
+};
+
+// one connected client
+// the backend feeds received bytes in, the server takes complete frames out,
+// and everything the server sends goes through the outbound queue
+struct Session : public std::enable_shared_from_this<Session> {
+    SOCKET socket;
+    std::string username;
+    // the user's id on the wire, 0 until joined
+    uint32_t user_id;
+    // presence version of the join, the others know the name once the
+    // presence window up to it went out
+    uint32_t join_version;
+    bool joined;
+
+    // receive side, only touched by the thread that reads this socket
+    std::vector<char> in_buffer;
+    size_t in_begin;
+    MessageHeader header;
+    bool has_header;
+
+    // send side, any thread may queue frames
+    std::mutex send_mutex;
+    OutboundQueue outbound;
+    std::atomic<bool> closing;
+
+    // reactor that owns the socket, null in blocking mode
+    // with an owner send_frame only queues, the loop writes everything
+    // queued during a batch in one go
+    Reactor* owner;
+    bool flush_scheduled;
+    // queue limits, none until the user joins
+    Backpressure* limits;
+    // presence version the client's user list is at, 0 before the first
+    // full list; the owning reactor updates it (any thread in blocking mode,
+    // where a lost race only costs the client a full list request)
+    std::atomic<uint32_t> presence_version;
+    // user list being paged out to the client and its version, the client
+    // pulls one page at a time; a client without presence deltas gets a new
+    // list from the presence thread too
+    std::mutex listing_mutex;
+    std::shared_ptr<const std::vector<UserEntry>> listing;
+    uint32_t listing_version;
+    // what the connection negotiated at CLIENT_CONNECT, fixed once joined
+    uint8_t version;
+    uint32_t capabilities;
+    // what the client compressed, receive side like in_buffer; the frames
+    // of the last compressed frame, kept so the buffer is reused
+    std::unique_ptr<LzDecoder> inflater;
+    std::vector<char> inflated;
+    // backend specific connection id
+    uint64_t conn_id;
+
+    explicit Session(SOCKET s)
+        : socket(s), user_id(0), join_version(0), joined(false), in_begin(0), has_header(false),
+          closing(false), owner(nullptr), flush_scheduled(false), limits(nullptr), presence_version(0), listing_version(0), version(0), capabilities(0), conn_id(0)
+    {}
+
+    // read everything the kernel has for us, returns false when the peer is gone
+    bool read_available()
+    {
+        char chunk[4096];
+        while (true) {
+            int received = recv(socket, chunk, sizeof(chunk), 0);
+            if (received > 0) {
+                in_buffer.insert(in_buffer.end(), chunk, chunk + received);
+                continue;
+            }
+            if (received == 0)
+                return false;
+
+            int error = socket_error();
+            if (socket_interrupted(error))
+                continue;
+            return socket_would_block(error);
+        }
+    }
+
+    // call on_frame(type, body, size) for every complete frame in the buffer
+    // returns false if the stream is broken (bad header, oversized body)
+    template <typename F>
+    bool parse_frames(F&& on_frame)
+    {
+        bool intact = true;
+        while (!closing) {
+            size_t available = in_buffer.size() - in_begin;
+
+            if (!has_header) {
+                size_t length = 0;
+                int state = header.decode(in_buffer.data() + in_begin, available, length);
+                if (state < 0)
+                    intact = false;
+                if (state <= 0)
+                    break;
+                in_begin += length;
+                available -= length;
+                has_header = true;
+            }
+
+            if (available < header.size)
+                break;
+
+            const char* body = in_buffer.data() + in_begin;
+            in_begin += header.size;
+            has_header = false;
+            on_frame(header.type, body, (int)header.size);
+        }
+
+        // drop consumed bytes
+        if (in_begin == in_buffer.size()) {
+            in_buffer.clear();
+            in_begin = 0;
+        }
+        else if (in_begin > 4096) {
+            in_buffer.erase(in_buffer.begin(), in_buffer.begin() + in_begin);
+            in_begin = 0;
+        }
+        return intact;
+    }
+
+    bool has(uint32_t capability) const { return (capabilities & capability) != 0; }
+
+    void negotiate(uint8_t v, uint32_t caps)
+    {
+        version = v;
+        capabilities = caps;
+        if (has(CAP_COMPRESSION))
+            inflater.reset(new LzDecoder());
+
+        std::lock_guard<std::mutex> lock(send_mutex);
+        outbound.batching = has(CAP_BATCH);
+        if (has(CAP_COMPRESSION))
+            outbound.encoder.reset(new LzEncoder());
+    }
+
+    // queue header and body, blocking mode writes them right away
+    // returns false if the socket failed
+    bool send_frame(MessageType type, const void* data, int size, uint32_t sender = SYSTEM_USER_ID)
+    {
+        return send_frame(type, make_body(data, size), sender);
+    }
+
+    // the body is shared, not copied
+    bool send_frame(MessageType type, const SharedBody& body, uint32_t sender = SYSTEM_USER_ID)
+    {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        if (closing)
+            return false;
+
+        outbound.push(type, body, sender);
+        if (!enforce_limits(type)) {
+            closing = true;
+            return false;
+        }
+
+        if (owner != nullptr) {
+            if (!flush_scheduled) {
+                flush_scheduled = true;
+                owner->schedule_flush(shared_from_this());
+            }
+            return true;
+        }
+        return flush_locked();
+    }
+
+    // keep a client that stops reading from growing its queue without
+    // bound, returns false if it has to be disconnected
+    bool enforce_limits(MessageType pushed)
+    {
+        if (limits == nullptr || outbound.pending <= limits->low_watermark)
+            return true;
+
+        // backlogged: only the newest user list is worth sending
+        if (pushed == MessageType::USER_LIST_UPDATE)
+            limits->userlists_coalesced += outbound.drop_stale(MessageType::USER_LIST_UPDATE);
+
+        if (outbound.pending <= limits->high_watermark)
+            return true;
+
+        // pieces of long public messages go first, the client drops a text
+        // it misses a piece of
+        if (limits->policy == SlowConsumerPolicy::DROP) {
+            limits->fragments_dropped += outbound.drop_oldest(MessageType::PUBLIC_FRAGMENT, limits->low_watermark);
+            limits->publics_dropped += outbound.drop_oldest(MessageType::PUBLIC_MESSAGE, limits->low_watermark);
+        }
+
+        // private messages are never dropped, past that the client goes
+        if (outbound.pending > limits->high_watermark) {
+            limits->disconnects++;
+            return false;
+        }
+        return true;
+    }
+
+    // called by the reactor when the socket is writable again
+    bool flush()
+    {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        return flush_locked();
+    }
+
+    bool flush_locked()
+    {
+        if (outbound.write_to(socket))
+            return true;
+
+        closing = true;
+        return false;
+    }
+};
+
+// the server side of the backends: what to do with a session's traffic
+class SessionHandler {
+public:
+    virtual ~SessionHandler() {}
+
+    // new bytes are in session->in_buffer
+    virtual void on_session_data(const std::shared_ptr<Session>& session) = 0;
+    // the connection is gone, called once per session
+    virtual void on_session_close(const std::shared_ptr<Session>& session) = 0;
+};
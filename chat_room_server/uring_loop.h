@@ -0,0 +1,632 @@
+﻿#pragma once
+// io_uring reactor, linux only
+// same threading model as EpollReactor (one thread per shard of sessions) but
+// accept and recv are multishot requests feeding from a provided buffer ring,
+// and queued output is submitted as linked sends for all sessions at once,
+// so a broadcast costs one io_uring_enter instead of a send() per recipient
+#ifdef __linux__
+#include "session.h"
+#include "reactor.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+// minimal wrapper over the raw io_uring syscalls, no liburing needed
+class IoRing {
+public:
+    int ring_fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    io_uring_sqe* sqes;
+    unsigned sqe_tail;   // next sqe we fill, published on submit
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+
+    IoRing() : ring_fd(-1), sq_entries(0), sqes(nullptr), sqe_tail(0),
+        sq_ptr(MAP_FAILED), sq_size(0), cq_ptr(MAP_FAILED), cq_size(0), sqes_size(0)
+    {}
+
+    ~IoRing() {
+        destroy();
+    }
+
+    bool init(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        // completions arrive in bursts (one per recipient), give them room
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = entries * 4;
+
+        ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0 && errno == EINVAL) {
+            // older kernel, retry without the optional flags
+            params.flags = IORING_SETUP_CQSIZE;
+            ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        }
+        if (ring_fd < 0)
+            return false;
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+            return false;
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ptr = sq_ptr;
+        }
+        else {
+            cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED)
+                return false;
+        }
+
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqe_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqe_ptr == MAP_FAILED)
+            return false;
+        sqes = (io_uring_sqe*)sqe_ptr;
+
+        char* sq = (char*)sq_ptr;
+        sq_head = (unsigned*)(sq + params.sq_off.head);
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        sqe_tail = *sq_tail;
+
+        char* cq = (char*)cq_ptr;
+        cq_head = (unsigned*)(cq + params.cq_off.head);
+        cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    void destroy() {
+        if (sqes != nullptr)
+            munmap(sqes, sqes_size);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED)
+            munmap(sq_ptr, sq_size);
+        if (ring_fd >= 0)
+            ::close(ring_fd);
+
+        sqes = nullptr;
+        sq_ptr = cq_ptr = MAP_FAILED;
+        ring_fd = -1;
+    }
+
+    // room for count more entries, submitting what is queued if needed;
+    // a linked chain has to go in one submit, the kernel ends a link at the
+    // end of a submit
+    bool reserve(unsigned count) {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (sqe_tail - head + count > sq_entries) {
+            submit(0);
+            head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        }
+        return sqe_tail - head + count <= sq_entries;
+    }
+
+    // next free submission entry, zeroed; submits early if the ring is full
+    io_uring_sqe* get_sqe() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (sqe_tail - head >= sq_entries) {
+            submit(0);
+            head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            if (sqe_tail - head >= sq_entries)
+                return nullptr;
+        }
+
+        unsigned index = sqe_tail & *sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        sqe_tail++;
+        return sqe;
+    }
+
+    // publish filled entries and enter the kernel, optionally waiting
+    // returns a negative errno on failure
+    int submit(unsigned wait_nr) {
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+        unsigned pending = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int ret = (int)syscall(__NR_io_uring_enter, ring_fd, pending, wait_nr, flags, nullptr, 0);
+        return ret < 0 ? -errno : ret;
+    }
+
+    // hand every ready completion to on_cqe, returns how many there were
+    template <typename F>
+    unsigned drain(F&& on_cqe) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+
+        while (head != tail) {
+            io_uring_cqe cqe = cqes[head & *cq_mask];
+            head++;
+            count++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            on_cqe(cqe);
+        }
+        return count;
+    }
+};
+
+// fixed-size receive buffers the kernel picks from for multishot recv
+class ProvidedBuffers {
+public:
+    // the ring is used as a plain io_uring_buf array: compiled as C++ the
+    // header's flexible "bufs" member sits behind an empty struct and is
+    // misplaced, the tail lives in the resv field of the first slot
+    io_uring_buf* ring;
+    size_t ring_size;
+    std::vector<char> storage;
+    unsigned entries;
+    unsigned buffer_size;
+    uint16_t group;
+    uint16_t tail;
+
+    ProvidedBuffers() : ring(nullptr), ring_size(0), entries(0), buffer_size(0), group(0), tail(0)
+    {}
+
+    ~ProvidedBuffers() {
+        if (ring != nullptr)
+            munmap(ring, ring_size);
+    }
+
+    // entries must be a power of two
+    bool init(IoRing& io, unsigned count, unsigned size, uint16_t group_id) {
+        entries = count;
+        buffer_size = size;
+        group = group_id;
+
+        ring_size = entries * sizeof(io_uring_buf);
+        void* mem = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return false;
+        ring = (io_uring_buf*)mem;
+
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)ring;
+        reg.ring_entries = entries;
+        reg.bgid = group;
+        if (syscall(__NR_io_uring_register, io.ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            return false;
+
+        storage.resize((size_t)entries * buffer_size);
+        for (unsigned i = 0; i < entries; i++) {
+            recycle((uint16_t)i);
+        }
+        publish();
+        return true;
+    }
+
+    const char* data(uint16_t bid) const {
+        return storage.data() + (size_t)bid * buffer_size;
+    }
+
+    // give a consumed buffer back, visible to the kernel after publish()
+    void recycle(uint16_t bid) {
+        io_uring_buf* buf = &ring[tail & (entries - 1)];
+        buf->addr = (uint64_t)(uintptr_t)data(bid);
+        buf->len = buffer_size;
+        buf->bid = bid;
+        tail++;
+    }
+
+    void publish() {
+        __atomic_store_n(&ring[0].resv, tail, __ATOMIC_RELEASE);
+    }
+};
+
+class UringReactor : public Reactor {
+public:
+    // what a completion belongs to, kept in the top byte of user_data
+    enum Op : uint64_t {
+        OP_ACCEPT = 1,
+        OP_RECV,
+        OP_SEND,
+        OP_WAKE,
+    };
+
+    // per-connection bookkeeping, kept until the kernel is done with the socket
+    struct Connection {
+        std::shared_ptr<Session> session;
+        std::deque<OutboundFrame> sending;  // frames referenced by in-flight sends
+        std::vector<iovec> slices;          // their headers and bodies
+        std::vector<msghdr> messages;       // one per linked sendmsg
+        std::vector<size_t> send_sizes;     // bytes each of them has to write
+        int inflight;               // requests that will still complete
+        int sends_left;             // sends of the current chain
+        bool closed;
+
+        Connection() : inflight(0), sends_left(0), closed(false) {}
+    };
+
+    // large flushes are split into linked sendmsgs of this many slices
+    static const size_t SEND_SLICES = 1024;
+    static const uint16_t BUFFER_GROUP = 1;
+
+    SessionHandler* handler;
+    SOCKET listen_socket;
+    IoRing ring;
+    ProvidedBuffers buffers;
+    bool buffers_dirty;
+    int wake_fd;
+    uint64_t wake_value;
+    std::unordered_map<uint64_t, Connection> connections;
+    uint64_t next_id;
+    std::vector<std::shared_ptr<Session>> flush_list;
+    std::vector<std::shared_ptr<Session>> close_list;
+
+    UringReactor() : handler(nullptr), listen_socket(INVALID_SOCKET), buffers_dirty(false),
+        wake_fd(-1), wake_value(0), next_id(1)
+    {}
+
+    ~UringReactor() {
+        stop();
+        // closed last, other reactors may still wake this one while they stop
+        if (wake_fd >= 0)
+            ::close(wake_fd);
+    }
+
+    static uint64_t make_data(Op op, uint64_t id) {
+        return ((uint64_t)op << 56) | id;
+    }
+
+    bool start(SOCKET listener, SessionHandler* h, int shard) {
+        index = shard;
+        handler = h;
+        listen_socket = listener;
+
+        if (!ring.init(4096)) {
+            std::cerr << "io_uring setup failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (!buffers.init(ring, 4096, 4096, BUFFER_GROUP)) {
+            std::cerr << "io_uring buffer ring registration failed: " << strerror(errno) << std::endl;
+            ring.destroy();
+            return false;
+        }
+
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (wake_fd < 0) {
+            ring.destroy();
+            return false;
+        }
+
+        arm_accept();
+        arm_wake();
+
+        return true;
+    }
+
+    void stop() override {
+        if (!running.exchange(false))
+            return;
+
+        wake();
+
+        if (loop_thread.joinable())
+            loop_thread.join();
+
+        for (auto& entry : connections) {
+            closesocket(entry.second.session->socket);
+        }
+        connections.clear();
+
+        ring.destroy();
+    }
+
+    void wake() override {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {}
+    }
+
+    void defer_close(const std::shared_ptr<Session>& session) override {
+        session->closing = true;
+        close_list.push_back(session);
+    }
+
+    void schedule_flush(const std::shared_ptr<Session>& session) override {
+        flush_list.push_back(session);
+    }
+
+    void run() override {
+        enter_loop();
+
+        while (running) {
+            // work other shards posted
+            run_mailbox();
+
+            // output reaches the kernel before closes shut sockets down,
+            // so a last message to a closing session still leaves
+            submit_sends();
+            if (!close_list.empty()) {
+                ring.submit(0);
+                close_deferred();
+                // what the closes broadcast
+                submit_sends();
+            }
+
+            int ret = ring.submit(1);
+            if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+                std::cerr << "io_uring_enter failed: " << strerror(-ret) << std::endl;
+                break;
+            }
+
+            ring.drain([this](const io_uring_cqe& cqe) {
+                handle_completion(cqe);
+            });
+
+            if (buffers_dirty) {
+                buffers.publish();
+                buffers_dirty = false;
+            }
+        }
+    }
+
+    void arm_accept() {
+        io_uring_sqe* sqe = ring.get_sqe();
+        if (sqe == nullptr)
+            return;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_socket;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = make_data(OP_ACCEPT, 0);
+    }
+
+    void arm_wake() {
+        io_uring_sqe* sqe = ring.get_sqe();
+        if (sqe == nullptr)
+            return;
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wake_fd;
+        sqe->addr = (uint64_t)(uintptr_t)&wake_value;
+        sqe->len = sizeof(wake_value);
+        sqe->user_data = make_data(OP_WAKE, 0);
+    }
+
+    void arm_recv(uint64_t id, Connection& conn) {
+        io_uring_sqe* sqe = ring.get_sqe();
+        if (sqe == nullptr) {
+            defer_close(conn.session);
+            return;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn.session->socket;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->user_data = make_data(OP_RECV, id);
+        conn.inflight++;
+    }
+
+    void handle_completion(const io_uring_cqe& cqe) {
+        Op op = (Op)(cqe.user_data >> 56);
+        uint64_t id = cqe.user_data & ((1ull << 56) - 1);
+        bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+        // the mailbox is drained at the top of the loop
+        if (op == OP_WAKE) {
+            if (running)
+                arm_wake();
+            return;
+        }
+
+        if (op == OP_ACCEPT) {
+            if (cqe.res >= 0)
+                add_connection(cqe.res);
+            else if (cqe.res != -ECANCELED)
+                std::cerr << "Accept failed: " << strerror(-cqe.res) << std::endl;
+            if (!more && running)
+                arm_accept();
+            return;
+        }
+
+        auto it = connections.find(id);
+        if (it == connections.end())
+            return;
+        Connection& conn = it->second;
+
+        if (op == OP_RECV) {
+            if (!more)
+                conn.inflight--;
+
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                uint16_t bid = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                if (cqe.res > 0 && !conn.closed) {
+                    const char* data = buffers.data(bid);
+                    conn.session->in_buffer.insert(conn.session->in_buffer.end(), data, data + cqe.res);
+                }
+                buffers.recycle(bid);
+                buffers_dirty = true;
+            }
+
+            if (!conn.closed) {
+                if (cqe.res > 0)
+                    handler->on_session_data(conn.session);
+                else if (cqe.res != -ENOBUFS)
+                    defer_close(conn.session);
+
+                // multishot ended (buffers ran out or the kernel gave up), re-arm
+                if (!more && !conn.closed && !conn.session->closing && (cqe.res > 0 || cqe.res == -ENOBUFS))
+                    arm_recv(id, conn);
+            }
+        }
+        else if (op == OP_SEND) {
+            // the chain completes in order
+            size_t expected = conn.send_sizes[conn.send_sizes.size() - conn.sends_left];
+            conn.inflight--;
+            conn.sends_left--;
+
+            // a short send leaves the stream cut mid frame
+            if ((cqe.res < 0 || (size_t)cqe.res != expected) && !conn.closed)
+                defer_close(conn.session);
+
+            if (conn.sends_left == 0) {
+                conn.sending.clear();
+                if (!conn.closed && !conn.session->outbound.empty())
+                    flush_list.push_back(conn.session);
+            }
+        }
+
+        release_if_done(it);
+    }
+
+    void add_connection(SOCKET client_socket) {
+        int nodelay = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        uint64_t id = next_id++;
+        std::shared_ptr<Session> session = std::make_shared<Session>(client_socket);
+        session->owner = this;
+        session->conn_id = id;
+
+        Connection& conn = connections[id];
+        conn.session = session;
+        arm_recv(id, conn);
+    }
+
+    // turn every session's queued frames into one chain of linked sendmsgs,
+    // headers and bodies are gathered straight from the queue
+    void submit_sends() {
+        for (size_t i = 0; i < flush_list.size(); i++) {
+            std::shared_ptr<Session> session = flush_list[i];
+            auto it = connections.find(session->conn_id);
+            if (it == connections.end())
+                continue;
+            Connection& conn = it->second;
+
+            std::lock_guard<std::mutex> lock(session->send_mutex);
+            session->flush_scheduled = false;
+            // one chain at a time keeps the byte order, the rest waits for it
+            if (conn.closed || conn.sends_left > 0 || session->outbound.empty())
+                continue;
+
+            // nothing is ever partially written here, sends complete in full;
+            // a long backlog goes a part at a time, the next part once this
+            // chain completes
+            conn.sending = session->outbound.take(FLUSH_AHEAD);
+
+            if (session->outbound.encoder)
+                compress_frames(conn.sending, *session->outbound.encoder);
+            else if (session->outbound.batching)
+                batch_frames(conn.sending, 0);
+
+            conn.slices.clear();
+            for (const OutboundFrame& frame : conn.sending) {
+                iovec slice;
+                if (frame.batch_header_size > 0) {
+                    slice.iov_base = (void*)frame.batch_header;
+                    slice.iov_len = frame.batch_header_size;
+                    conn.slices.push_back(slice);
+                }
+                slice.iov_base = (void*)frame.header;
+                slice.iov_len = frame.header_size;
+                conn.slices.push_back(slice);
+                if (!frame.body->empty()) {
+                    slice.iov_base = (void*)frame.body->data();
+                    slice.iov_len = frame.body->size();
+                    conn.slices.push_back(slice);
+                }
+            }
+
+            size_t total = conn.slices.size();
+            conn.messages.assign((total + SEND_SLICES - 1) / SEND_SLICES, msghdr());
+            conn.send_sizes.assign(conn.messages.size(), 0);
+            // the whole chain or none of it, a half queued chain would link
+            // into whatever is queued next
+            if (!ring.reserve((unsigned)conn.messages.size())) {
+                defer_close(session);
+                continue;
+            }
+            for (size_t first = 0; first < total; first += SEND_SLICES) {
+                size_t count = total - first;
+                if (count > SEND_SLICES)
+                    count = SEND_SLICES;
+
+                io_uring_sqe* sqe = ring.get_sqe();
+
+                msghdr& message = conn.messages[first / SEND_SLICES];
+                memset(&message, 0, sizeof(message));
+                message.msg_iov = conn.slices.data() + first;
+                message.msg_iovlen = count;
+                for (size_t n = first; n < first + count; n++)
+                    conn.send_sizes[first / SEND_SLICES] += conn.slices[n].iov_len;
+
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = session->socket;
+                sqe->addr = (uint64_t)(uintptr_t)&message;
+                sqe->len = 1;
+                // WAITALL retries short sends so the link is only broken by errors
+                sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+                if (first + count < total)
+                    sqe->flags = IOSQE_IO_LINK;
+                sqe->user_data = make_data(OP_SEND, session->conn_id);
+
+                conn.inflight++;
+                conn.sends_left++;
+            }
+        }
+        flush_list.clear();
+    }
+
+    void close_deferred() {
+        for (size_t i = 0; i < close_list.size(); i++) {
+            std::shared_ptr<Session> session = close_list[i];
+            auto it = connections.find(session->conn_id);
+            if (it == connections.end() || it->second.closed)
+                continue;
+
+            it->second.closed = true;
+            handler->on_session_close(session);
+
+            // completes the pending recv and sends, the socket is closed
+            // when the last of them comes back
+            shutdown(session->socket, SHUT_RDWR);
+            release_if_done(it);
+        }
+        close_list.clear();
+    }
+
+    void release_if_done(std::unordered_map<uint64_t, Connection>::iterator it) {
+        if (it->second.closed && it->second.inflight == 0) {
+            closesocket(it->second.session->socket);
+            connections.erase(it);
+        }
+    }
+};
+#endif